@@ -0,0 +1,1652 @@
+/*******************************************************************************
+ * Name        : bench.cpp
+ * Author      : Ben Blease
+ * Date        : 10/24/17
+ * Description : Timing and allocation benchmarks for the network
+ ******************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "core.h"
+#include "corpus.h"
+#include "server.h"
+#include "frozen.h"
+#include "sampler.h"
+#include "beam.h"
+
+using namespace std;
+
+/*
+Count every heap allocation made through operator new
+Read before and after a section to get its allocation count
+Every form of new and delete goes through the two functions below, kept out of line so the
+compiler never pairs an inlined free with the new it sees at a call site
+*/
+static size_t alloc_count = 0;
+
+__attribute__((noinline)) static void* counted_alloc(size_t n){
+  alloc_count++;
+  void* p = malloc(n ? n : 1);
+  if (!p)
+    throw bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) static void counted_free(void* p){
+  free(p);
+}
+
+void* operator new(size_t n){
+  return counted_alloc(n);
+}
+
+void* operator new[](size_t n){
+  return counted_alloc(n);
+}
+
+void operator delete(void* p) noexcept {
+  counted_free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  counted_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  counted_free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  counted_free(p);
+}
+
+typedef chrono::high_resolution_clock Clock;
+
+static double seconds_since(Clock::time_point start){
+  return chrono::duration<double>(Clock::now() - start).count();
+}
+
+/* Microseconds per call, the best of five batches of reps calls after one to warm up */
+template <class F>
+static double best_us(F f, int reps){
+  f();
+  double best = 1e30;
+  for (int batch = 0; batch < 5; batch++){
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < reps; i++)
+      f();
+    best = min(best, seconds_since(start) / reps * 1e6);
+  }
+  return best;
+}
+
+/* Deterministic pseudo-text so runs are comparable without an input file */
+static string* synthetic_text(size_t len){
+  const char* words[] = {"the ", "network ", "learns ", "a ", "sequence ", "of ", "characters, ",
+                         "memory ", "cells ", "remember. ", "Long ", "short ", "term ", "state "};
+  size_t count = sizeof(words) / sizeof(words[0]);
+  string* out = new string();
+  unsigned int seed = 12345;
+  while (out->length() < len){
+    seed = seed * 1103515245 + 12345;
+    *out += words[(seed >> 16) % count];
+  }
+  out->resize(len);
+  return out;
+}
+
+template <class T>
+static vector<T> random_vector(size_t n, double scale){
+  vector<T> out = vector<T>(n);
+  for (size_t i = 0; i < n; i++)
+    out[i] = (((double) rand() / RAND_MAX) * 2 - 1) * scale;
+  return out;
+}
+
+template <class T>
+static double max_error(const vector<T>& a, const vector<T>& b){
+  double err = 0.0;
+  for (size_t i = 0; i < a.size(); i++)
+    err = max(err, (double) fabs(a[i] - b[i]));
+  return err;
+}
+
+/*
+Check every supported instruction set against the scalar reference
+Lengths are odd so the tail handling is exercised
+Returns false if any kernel is out of tolerance
+*/
+template <class T>
+static bool check_kernels(const char* type, double tol){
+  const Kernels<T>* ref = kernels<T>(ISA_SCALAR);
+  size_t rows = 67, cols = 131, stride = 144;
+  vector<T> m = random_vector<T>(rows * stride, 1.0);
+  vector<T> a = random_vector<T>(cols, 1.0);
+  vector<T> b = random_vector<T>(cols, 1.0);
+  vector<T> x = random_vector<T>(cols, 20.0);
+  vector<int8_t> q(rows * stride);
+  for (size_t i = 0; i < q.size(); i++)
+    q[i] = (int8_t) (rand() % 255 - 127);
+  vector<float> qs = random_vector<float>(rows, 0.01);
+  bool ok = true;
+
+  for (int i = ISA_SSE2; i < ISA_COUNT; i++){
+    const Kernels<T>* k = kernels<T>((Isa) i);
+    if (!k){
+      printf("kernels   %-7s %-6s unsupported\n", isa_name((Isa) i), type);
+      continue;
+    }
+    double err = fabs(k->dot(a.data(), b.data(), cols) - ref->dot(a.data(), b.data(), cols));
+
+    vector<T> r1 = vector<T>(cols), r2 = vector<T>(cols);
+    k->h_prod(a.data(), b.data(), r1.data(), cols);
+    ref->h_prod(a.data(), b.data(), r2.data(), cols);
+    err = max(err, max_error(r1, r2));
+
+    k->axpy(0.5, a.data(), r1.data(), cols);
+    ref->axpy(0.5, a.data(), r2.data(), cols);
+    err = max(err, max_error(r1, r2));
+
+    vector<T> g1 = vector<T>(rows, 1.0), g2 = vector<T>(rows, 1.0);
+    k->gemv(m.data(), rows, cols, stride, a.data(), g1.data(), true);
+    ref->gemv(m.data(), rows, cols, stride, a.data(), g2.data(), true);
+    err = max(err, max_error(g1, g2));
+
+    //int8 weights with a scale per row
+    k->gemv_q8(q.data(), rows, cols, stride, qs.data(), a.data(), g1.data(), true);
+    ref->gemv_q8(q.data(), rows, cols, stride, qs.data(), a.data(), g2.data(), true);
+    err = max(err, max_error(g1, g2));
+
+    //odd batch of five streams, rows of x as the stream inputs
+    size_t batch = 5;
+    vector<T> b1 = vector<T>(batch * rows, 1.0), b2 = b1;
+    k->gemm(m.data(), rows, cols, stride, m.data(), stride, b1.data(), rows, batch, true);
+    ref->gemm(m.data(), rows, cols, stride, m.data(), stride, b2.data(), rows, batch, true);
+    err = max(err, max_error(b1, b2));
+
+    //transposed product over the same streams, cols wide rows
+    vector<T> t1 = vector<T>(batch * cols, 1.0), t2 = t1;
+    k->row_update(t1.data(), batch, cols, cols, 0.5, m.data(), stride, 1, m.data(), stride, rows);
+    ref->row_update(t2.data(), batch, cols, cols, 0.5, m.data(), stride, 1, m.data(), stride, rows);
+    err = max(err, max_error(t1, t2));
+
+    //sum of outer products, coefficients a column of m as in the gradient update
+    vector<T> u1 = vector<T>(rows * cols, 1.0), u2 = u1;
+    k->row_update(u1.data(), rows, cols, cols, 0.5, m.data(), 1, stride, m.data(), stride, rows);
+    ref->row_update(u2.data(), rows, cols, cols, 0.5, m.data(), 1, stride, m.data(), stride, rows);
+    err = max(err, max_error(u1, u2));
+
+    //output layer with W as rows x cols, a target and the delta to the block
+    vector<T> xo = random_vector<T>(rows, 1.0);
+    vector<T> o1 = vector<T>(cols), o2 = vector<T>(cols), dx1 = vector<T>(rows), dx2 = vector<T>(rows);
+    T ly1 = 0, ly2 = 0;
+    T z1 = k->output(m.data(), rows, cols, stride, b.data(), xo.data(), o1.data(), 7, dx1.data(), &ly1);
+    T z2 = ref->output(m.data(), rows, cols, stride, b.data(), xo.data(), o2.data(), 7, dx2.data(), &ly2);
+    err = max(err, max(max_error(o1, o2), max_error(dx1, dx2)));
+    err = max(err, max((double) fabs(z1 - z2) / z2, (double) fabs(ly1 - ly2)));
+
+    for (int f = SIGMOID; f < ACTIVATION_COUNT; f++){
+      k->activate[f](x.data(), r1.data(), cols);
+      ref->activate[f](x.data(), r2.data(), cols);
+      err = max(err, max_error(r1, r2));
+    }
+
+    //fused cell on an odd cell count, bias and previous state random
+    size_t n = cols / 4;
+    vector<T> p1 = random_vector<T>(4 * n, 3.0), p2 = p1;
+    vector<T> bias = random_vector<T>(4 * n, 1.0), cp = random_vector<T>(n, 1.0);
+    vector<T> act1 = vector<T>(4 * n), act2 = vector<T>(4 * n);
+    vector<T> c1 = vector<T>(n), c2 = vector<T>(n), h1 = vector<T>(n), h2 = vector<T>(n);
+    k->lstm_cell(p1.data(), bias.data(), cp.data(), act1.data(), c1.data(), h1.data(), n);
+    ref->lstm_cell(p2.data(), bias.data(), cp.data(), act2.data(), c2.data(), h2.data(), n);
+    err = max(err, max(max_error(p1, p2), max_error(act1, act2)));
+    err = max(err, max(max_error(c1, c2), max_error(h1, h2)));
+
+    printf("kernels   %-7s %-6s max error %.3g %s\n", k->name, type, err, err < tol ? "ok" : "FAILED");
+    ok = ok && err < tol;
+  }
+  return ok;
+}
+
+/* GEMV and activation throughput for each instruction set, the best of several batches as single runs are noisy */
+template <class T>
+static void bench_kernels(const char* type, size_t n, int reps){
+  Matrix<T> m = Matrix<T>(n, 4 * n);
+  m.randomize();
+  vector<T> x = random_vector<T>(n, 1.0);
+  vector<T> out = vector<T>(4 * n);
+
+  for (int i = ISA_SCALAR; i < ISA_COUNT; i++){
+    const Kernels<T>* k = kernels<T>((Isa) i);
+    if (!k)
+      continue;
+    double gemv = best_us([&](){ k->gemv(m.data(), m.rows(), m.cols(), m.stride(), x.data(), out.data(), false); }, reps);
+    double act = best_us([&](){ k->activate[SIGMOID](out.data(), out.data(), out.size()); }, reps);
+
+    printf("kernels   %-7s %-6s n=%-4zu gemv %8.2f us  sigmoid %8.2f us\n", k->name, type, n, gemv, act);
+  }
+}
+
+/*
+Error and speed of each activation accuracy tier on the best instruction set,
+against the exact scalar reference; the error is absolute, over inputs in [-20, 20]
+Returns false if a tier misses its nominal error by more than a factor of two
+*/
+template <class T>
+static bool bench_tiers(const char* type, size_t n, int reps){
+  static const double nominal[ACC_COUNT] = {0.0, 1e-6, 1e-3};
+  const Kernels<T>* ref = kernels<T>(ISA_SCALAR);
+  const Kernels<T>* best = &kernels<T>();
+  vector<T> x = random_vector<T>(n, 20.0);
+  vector<T> r1 = vector<T>(n), r2 = vector<T>(n);
+  bool ok = true;
+  double base = 0.0;
+
+  for (int a = ACC_EXACT; a < ACC_COUNT; a++){
+    Isa isa = ISA_SCALAR;
+    for (int i = ISA_SCALAR; i < ISA_COUNT; i++)
+      if (kernels<T>((Isa) i) == best)
+        isa = (Isa) i;
+    const Kernels<T>* k = kernels<T>(isa, (Accuracy) a);
+
+    double err = 0.0;
+    for (int f = SIGMOID; f <= DERIV_TANH; f++){
+      k->activate[f](x.data(), r1.data(), n);
+      ref->activate[f](x.data(), r2.data(), n);
+      err = max(err, max_error(r1, r2));
+    }
+
+    Clock::time_point start = Clock::now();
+    for (int r = 0; r < reps; r++){
+      k->activate[SIGMOID](x.data(), r1.data(), n);
+      k->activate[TANH](x.data(), r1.data(), n);
+    }
+    double elapsed = seconds_since(start) / reps;
+    if (a == ACC_EXACT)
+      base = elapsed;
+
+    //the exact tier is held to the tolerance of check_kernels instead
+    bool pass = (a == ACC_EXACT) || err < 2 * nominal[a];
+    printf("accuracy  %-7s %-6s %-5s max error %9.3g  sigmoid+tanh %8.2f us  speedup %5.2fx %s\n",
+           k->name, type, accuracy_name((Accuracy) a), err, elapsed * 1e6, base / elapsed, pass ? "ok" : "FAILED");
+    ok = ok && pass;
+  }
+  return ok;
+}
+
+/* Name of the numeric mode this binary was built with */
+static const char* precision_name(){
+  if (sizeof(real) == sizeof(double))
+    return "double";
+  return (sizeof(accum) == sizeof(double)) ? "mixed" : "single";
+}
+
+/* Perplexity of the network on text it has not trained on, from the output layer's loss */
+static double perplexity(Net* net, const string& text){
+  net->context->take_loss();
+  for (size_t i = 0; i + 1 < text.length(); i++){
+    int curr = char_index(text[i]);
+    int next = char_index(text[i + 1]);
+    net->input->forward(*net->context, NULL, &curr, &next);
+  }
+  return exp(net->context->take_loss());
+}
+
+/*
+Training throughput and held-out perplexity for the current numeric mode
+Run once per mode (make bench-precision) to compare them
+*/
+static void bench_precision(size_t hidden, int chars){
+  string* text = synthetic_text(chars + 5001);
+  string held_out = text->substr(chars + 1);
+  Net* net = new Net(text, 2, 95, hidden, 10);
+
+  streambuf* old = cout.rdbuf(NULL);
+  Clock::time_point start = Clock::now();
+  net->train(0.1, 0.01, chars);
+  double elapsed = seconds_since(start);
+  cout.rdbuf(old);
+
+  Clock::time_point gen = Clock::now();
+  double ppl = perplexity(net, held_out);
+  double run = seconds_since(gen);
+
+  printf("precision %-6s hidden=%-4zu train %8.0f chars/s  run %8.0f chars/s  perplexity %8.3f\n",
+         precision_name(), hidden, chars / elapsed, held_out.length() / run, ppl);
+  delete net;
+}
+
+/* Training throughput and held-out perplexity at each activation accuracy tier */
+static void bench_accuracy(size_t hidden, int chars){
+  string* text = synthetic_text(chars + 5001);
+  string held_out = text->substr(chars + 1);
+  Accuracy old_tier = accuracy();
+  for (int a = ACC_EXACT; a < ACC_COUNT; a++){
+    set_accuracy((Accuracy) a);
+    srand(1);
+    Net* net = new Net(new string(*text), 2, 95, hidden, 10);
+
+    streambuf* old = cout.rdbuf(NULL);
+    Clock::time_point start = Clock::now();
+    net->train(0.1, 0.01, chars, 4);
+    double elapsed = seconds_since(start);
+    cout.rdbuf(old);
+
+    printf("accuracy  %-5s hidden=%-4zu train %8.0f chars/s  perplexity %8.3f\n",
+           accuracy_name((Accuracy) a), hidden, chars / elapsed, perplexity(net, held_out));
+    delete net;
+  }
+  set_accuracy(old_tier);
+}
+
+/* Time inference steps through Input -> Block -> Output */
+static void bench_forward(size_t hidden, int steps){
+  Net* net = new Net(synthetic_text(1000), 2, 95, hidden, 10);
+  vector<real> x = vectorize('e');
+
+  //warm up so buffers reach their final size
+  net->input->forward(*net->context, NULL, x, NULL);
+
+  size_t allocs = alloc_count;
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < steps; i++)
+    net->input->forward(*net->context, NULL, x, NULL);
+  double elapsed = seconds_since(start);
+  allocs = alloc_count - allocs;
+
+  printf("forward   hidden=%-4zu %10.2f us/step %10.2f allocs/step  (dense input)\n",
+         hidden, elapsed / steps * 1e6, (double) allocs / steps);
+
+  //same steps with the one-hot input gathered by index
+  int index = char_index('e');
+  allocs = alloc_count;
+  start = Clock::now();
+  for (int i = 0; i < steps; i++)
+    net->input->forward(*net->context, NULL, &index, NULL);
+  elapsed = seconds_since(start);
+  allocs = alloc_count - allocs;
+
+  printf("forward   hidden=%-4zu %10.2f us/step %10.2f allocs/step  (one-hot index)\n",
+         hidden, elapsed / steps * 1e6, (double) allocs / steps);
+  delete net;
+}
+
+/*
+Time full training (forward + BPTT) over a number of lockstep streams and a BPTT window
+Returns characters per second
+*/
+static double bench_train(size_t hidden, int chars, int streams, int window){
+  Net* net = new Net(synthetic_text(chars + 1), 2, 95, hidden, window);
+
+  streambuf* old = cout.rdbuf(NULL);
+  size_t allocs = alloc_count;
+  Clock::time_point start = Clock::now();
+  net->train(0.1, 0.01, chars, streams);
+  double elapsed = seconds_since(start);
+  allocs = alloc_count - allocs;
+  cout.rdbuf(old);
+
+  printf("train     hidden=%-4zu streams=%-3d window=%-3d %10.0f chars/s  %10.2f allocs/char\n",
+         hidden, streams, window, chars / elapsed, (double) allocs / chars);
+  delete net;
+  return chars / elapsed;
+}
+
+/* Largest difference between two gradients over every layer */
+static double gradient_error(TimeRange* a, TimeRange* b){
+  double err = 0.0;
+  for (size_t l = 0; l < a->grad.size(); l++){
+    const Gradient& x = a->grad[l];
+    const Gradient& y = b->grad[l];
+    for (int i = 0; i < x.w.rows(); i++)
+      for (int j = 0; j < x.w.cols(); j++)
+        err = max(err, (double) fabs(x.w[i][j] - y.w[i][j]));
+    for (int i = 0; i < x.u.rows(); i++)
+      for (int j = 0; j < x.u.cols(); j++)
+        err = max(err, (double) fabs(x.u[i][j] - y.u[i][j]));
+    err = max(err, max_error(x.b, y.b));
+  }
+  return err;
+}
+
+/*
+Checkpointed BPTT against the full window on the same steps, then memory and
+throughput of long windows held in full and checkpointed every sqrt(window) steps
+Returns false if the gradients differ or a footprint estimate misses
+*/
+static bool bench_checkpoint(size_t hidden, int streams){
+  bool ok = true;
+  int window = 40;
+  Net* net = new Net(synthetic_text(window * streams + 1), 2, 95, hidden, window);
+  int intervals[] = {1, 7, 40};
+  for (int c : intervals){
+    TimeRange full = TimeRange(2, window, 95, hidden, streams, 0);
+    TimeRange ckpt = TimeRange(2, window, 95, hidden, streams, c);
+    vector<int> curr = vector<int>(streams), next = vector<int>(streams);
+    for (int t = 0; t < window; t++){
+      for (int k = 0; k < streams; k++){
+        curr[k] = char_index((*net->data)[k * window + t]);
+        next[k] = char_index((*net->data)[k * window + t + 1]);
+      }
+      net->step(&full, curr.data(), next.data());
+      net->step(&ckpt, curr.data(), next.data());
+    }
+    net->backprop(&full, next.data());
+    net->backprop(&ckpt, next.data());
+    double err = gradient_error(&full, &ckpt);
+    bool fits = ckpt.bytes() == TimeRange::footprint(2, window, 95, hidden, streams, c) &&
+                full.bytes() == TimeRange::footprint(2, window, 95, hidden, streams, 0);
+    printf("bptt      hidden=%-4zu window=%-4d checkpoint=%-3d gradient error %.3g  footprint %s %s\n",
+           hidden, window, c, err, fits ? "exact" : "MISSED", (err < 1e-9 && fits) ? "ok" : "FAILED");
+    ok = ok && err < 1e-9 && fits;
+  }
+  delete net;
+
+  int windows[] = {100, 1000};
+  for (int w : windows){
+    int c = (int) sqrt((double) w);
+    int chars = 4 * w * streams;
+    int modes[] = {0, c};
+    for (int m : modes){
+      Net* net = new Net(synthetic_text(chars + 1), 2, 95, hidden, w);
+      net->checkpoint = m;
+      streambuf* old = cout.rdbuf(NULL);
+      Clock::time_point start = Clock::now();
+      net->train(0.1, 0.01, chars, streams);
+      double rate = chars / seconds_since(start);
+      cout.rdbuf(old);
+      printf("bptt      hidden=%-4zu window=%-4d checkpoint=%-3d %8.2f MB  %10.0f chars/s\n",
+             hidden, w, m, net->time_vals[0]->bytes() / 1048576.0, rate);
+      delete net;
+    }
+  }
+
+  //a second run on the same net starts from an empty window, whatever the first left held
+  {
+    Net* net = new Net(synthetic_text(2006), 2, 95, hidden, 10);
+    net->checkpoint = 3;
+    streambuf* old = cout.rdbuf(NULL);
+    bool rerun = true;
+    try {
+      net->train(0.1, 0.01, 1005);
+      net->train(0.1, 0.01, 2005);
+    } catch (runtime_error& e){
+      rerun = false;
+    }
+    cout.rdbuf(old);
+    printf("bptt      hidden=%-4zu window=10   checkpoint=3   trained twice %s\n", hidden, rerun ? "ok" : "FAILED");
+    ok = ok && rerun;
+    delete net;
+  }
+
+  //longest window of 2 layers at hidden 256 that fits 64MB per worker
+  Net* big = new Net(synthetic_text(100), 2, 95, 256, 2000);
+  size_t budget = 64 << 20;
+  int c = big->plan_checkpoint(budget, streams);
+  printf("bptt      hidden=256  window=2000 budget %zu MB: full %.1f MB, checkpoint=%d %.1f MB\n", budget >> 20,
+         TimeRange::footprint(2, 2000, 95, 256, streams, 0) / 1048576.0, c,
+         TimeRange::footprint(2, 2000, 95, 256, streams, c) / 1048576.0);
+  delete big;
+  return ok;
+}
+
+/* pick_char as it was, a random_device, generator and distribution built for every character */
+static char rebuilt_pick_char(const vector<real>& v){
+  discrete_distribution<int> d(v.begin(), v.end());
+  random_device r;
+  mt19937 gen(r());
+  return (char) (d(gen) + 32);
+}
+
+/* Largest difference between how often draws land on each index and the expected share */
+static double draw_error(Sampler& sampler, const vector<real>& p, const vector<double>& expected, int draws){
+  vector<double> seen(p.size(), 0.0);
+  for (int i = 0; i < draws; i++)
+    seen[sampler.draw(p.data(), p.size())] += 1.0 / draws;
+  double err = 0.0;
+  for (size_t i = 0; i < p.size(); i++)
+    err = max(err, fabs(seen[i] - expected[i]));
+  return err;
+}
+
+/*
+The sampler against the old pick_char per draw, then its draws against the distributions each
+setting should give, the same seed giving the same draws, and frozen generation still not allocating
+*/
+static bool bench_sampler(int draws){
+  srand(1);
+  vector<real> p(95);
+  double total = 0;
+  for (real& x : p){
+    x = exp(3.0 * rand() / RAND_MAX);
+    total += x;
+  }
+  for (real& x : p)
+    x /= total;
+  vector<int> order(95);
+  for (int i = 0; i < 95; i++)
+    order[i] = i;
+  sort(order.begin(), order.end(), [&](int a, int b){ return p[a] > p[b]; });
+
+  size_t allocs = alloc_count;
+  Clock::time_point start = Clock::now();
+  char sink = 0;
+  for (int i = 0; i < draws / 10; i++)
+    sink ^= rebuilt_pick_char(p);
+  double old_ns = seconds_since(start) / (draws / 10) * 1e9;
+  double old_allocs = (double) (alloc_count - allocs) / (draws / 10);
+  printf("sampler   rebuilt per draw %8.1f ns %5.2f allocs\n", old_ns, old_allocs);
+
+  const char* names[] = {"plain", "temperature 0.5", "top-k 5", "top-p 0.5", "all three", "greedy"};
+  SampleParams settings[6];
+  settings[1].temperature = 0.5;
+  settings[2].top_k = 5;
+  settings[3].top_p = 0.5;
+  settings[4].temperature = 0.5;
+  settings[4].top_k = 20;
+  settings[4].top_p = 0.9;
+  settings[5].temperature = 0;
+
+  bool ok = true;
+  for (int k = 0; k < 6; k++){
+    //what each setting should draw from
+    const SampleParams& sp = settings[k];
+    vector<double> expected(95, 0.0);
+    double top = p[order[0]];
+    double held = 0, kept = 0;
+    size_t limit = sp.top_k ? sp.top_k : 95;
+    vector<double> q(95);
+    for (int i = 0; i < 95; i++)
+      q[i] = (sp.temperature > 0) ? pow(p[i] / top, 1 / sp.temperature) : 0;
+    for (int i = 0; i < 95; i++)
+      held += (i < (int) limit) ? q[order[i]] : 0;
+    double cut = sp.top_p * held;
+    held = 0;
+    for (size_t i = 0; i < limit && (held < cut || i == 0); i++){
+      held += q[order[i]];
+      expected[order[i]] = q[order[i]];
+      kept += q[order[i]];
+    }
+    for (double& e : expected)
+      e = (sp.temperature > 0) ? e / kept : 0;
+    if (sp.temperature <= 0)
+      expected[order[0]] = 1;
+
+    Sampler sampler(7, sp);
+    sampler.reserve(95);
+    allocs = alloc_count;
+    start = Clock::now();
+    for (int i = 0; i < draws; i++)
+      sink ^= sampler.pick(p.data(), 95);
+    double ns = seconds_since(start) / draws * 1e9;
+    size_t made = alloc_count - allocs;
+    double err = draw_error(sampler, p, expected, draws);
+
+    Sampler a(11, sp), b(11, sp);
+    bool same = true;
+    for (int i = 0; i < 1000; i++)
+      same = (a.draw(p.data(), 95) == b.draw(p.data(), 95)) && same;
+    bool good = err < 0.01 && same && made == 0;
+    ok = good && ok;
+    printf("sampler   %-16s %8.1f ns %zu allocs   frequency error %.4f   seeded repeat %s  %s\n",
+           names[k], ns, made, err, same ? "same" : "DIFFERS", good ? "ok" : "FAILED");
+  }
+
+  Net* net = new Net(synthetic_text(10), 2, 95, 64, 10);
+  Frozen frozen(*net);
+  frozen.sampler.params = settings[4];
+  vector<char> out(1000);
+  frozen.generate("The ", 4, &out[0], 10);
+  allocs = alloc_count;
+  frozen.generate("The ", 4, &out[0], out.size());
+  size_t made = alloc_count - allocs;
+  printf("sampler   frozen generation with all three: %zu allocs in %zu chars %s\n", made, out.size(), made ? "FAILED" : "ok");
+  delete net;
+  return ok && made == 0 && sink != 1;
+}
+
+/*
+Log-probability of a continuation of a prompt, fed one character at a time through the
+network's own context, the kernels beam search steps with
+*/
+static double sequence_score(Net* net, const string& prompt, const string& text){
+  net->context->reset();
+  for (char c : prompt)
+    net->feed(c);
+  double score = 0;
+  for (char c : text){
+    score += log(net->context->o[char_index(c)]);
+    net->feed(c);
+  }
+  return score;
+}
+
+/*
+Beam search of each width against as many separate Net::run calls, in characters of
+candidates generated per second, and the best score each finds
+Width one must match greedy decoding, and every beam's score the one its text gets
+when fed through alone, which checks the forked states; both feed through the blocks'
+kernels, as the frozen copy's sum differently and untrained weights soon amplify that
+*/
+static bool bench_beam(size_t hidden, size_t length){
+  srand(1);
+  Net* net = new Net(synthetic_text(10), 2, 95, hidden, 10);
+  net->trained = true;
+  string prompt = "The quick brown fox ";
+  net->context->reset();
+  for (char c : prompt)
+    net->feed(c);
+  string greedy;
+  for (size_t i = 0; i < length; i++){
+    greedy += max_pick_char(net->context->o);
+    net->feed(greedy.back());
+  }
+  vector<Beam> one = beam_search(net, prompt, length, 1);
+  bool ok = one[0].text == greedy;
+  printf("beam      hidden=%-4zu width 1 %s greedy decoding\n", hidden, ok ? "matches" : "DIFFERS FROM");
+
+  for (int width : {4, 16, 64}){
+    Clock::time_point start = Clock::now();
+    vector<Beam> beams = beam_search(net, prompt, length, width);
+    double beam_s = seconds_since(start);
+
+    double err = 0;
+    for (const Beam& b : beams)
+      err = max(err, fabs(b.score - sequence_score(net, prompt, b.text)));
+
+    streambuf* old = cout.rdbuf(NULL);
+    vector<string> runs;
+    start = Clock::now();
+    for (int k = 0; k < width; k++)
+      runs.push_back(net->run(length, prompt).substr(prompt.length()));
+    double run_s = seconds_since(start);
+    cout.rdbuf(old);
+    double sampled = -1e300;
+    for (const string& r : runs)
+      sampled = max(sampled, sequence_score(net, prompt, r));
+
+    bool good = err < 1e-6 && (int) beams.size() == width;
+    ok = good && ok;
+    printf("beam      hidden=%-4zu width %-3d %9.0f chars/s   %3d runs %9.0f chars/s  %5.2fx   best log-prob beam %8.2f runs %8.2f"
+           "  score error %.1e %s\n", hidden, width, width * length / beam_s, width, width * length / run_s,
+           run_s / beam_s, beams[0].score, sampled, err, good ? "ok" : "FAILED");
+  }
+  delete net;
+  return ok;
+}
+
+/*
+Fixed size kernels against the generic ones on the same network: steps of one stream, which
+keeps the generic kernels either way, and of a batch of streams through the blocks, checking
+the predictions agree
+Runs alternate between the two and the best of three is kept, the differences being small
+A hidden size without fixed kernels shows the fallback
+*/
+static bool bench_fixed(size_t hidden, int steps, int streams){
+  srand(1);
+  Net* net = new Net(synthetic_text(10), 2, 95, hidden, 10);
+  net->trained = true;
+  string* text = synthetic_text(steps + streams);
+  Context ctx(2, 95, hidden, streams);
+  vector<int> index(streams);
+
+  double us[2][2] = {{1e9, 1e9}, {1e9, 1e9}};
+  vector<real> o[2];
+  for (int rep = 0; rep < 3; rep++){
+    for (int fixed = 0; fixed < 2; fixed++){
+      net->specialize(fixed);
+      net->context->reset();
+      Clock::time_point start = Clock::now();
+      for (int i = 0; i < steps; i++)
+        net->feed((*text)[i]);
+      us[fixed][0] = min(us[fixed][0], seconds_since(start) / steps * 1e6);
+      o[fixed] = net->context->o;
+
+      ctx.reset();
+      start = Clock::now();
+      for (int i = 0; i < steps / 8; i++){
+        for (int k = 0; k < streams; k++)
+          index[k] = char_index((*text)[i + k]);
+        net->input->forward(ctx, NULL, index.data(), NULL);
+      }
+      us[fixed][1] = min(us[fixed][1], seconds_since(start) / (steps / 8) * 1e6);
+      o[fixed].insert(o[fixed].end(), ctx.o.begin(), ctx.o.end());
+    }
+  }
+  double err = max_error(o[0], o[1]);
+  bool built = fixed_shape<real>(hidden) >= 0;
+  bool ok = err <= ((sizeof (real) == sizeof (double)) ? 1e-12 : 1e-5);
+  printf("fixed     hidden=%-4zu %s  feed %7.2f -> %7.2f us   %d streams %8.2f -> %8.2f us/step"
+         "  max error %.1e %s\n", hidden, built ? "fixed  " : "generic", us[0][0], us[1][0], streams, us[0][1], us[1][1],
+         err, ok ? "ok" : "FAILED");
+  delete text;
+  delete net;
+  return ok;
+}
+
+/*
+The inference runtime against the training network's forward pass: the same predictions,
+the time per step, and heap allocations per generated character, the training path
+sampling with pick_char as Net::run used to
+*/
+static bool bench_frozen(size_t hidden, int steps){
+  srand(1);
+  Net* net = new Net(synthetic_text(10), 2, 95, hidden, 10);
+  net->trained = true;
+  Frozen frozen(*net);
+  string* text = synthetic_text(steps + 1);
+
+  //windows from a clear state, as the untrained weights amplify the last bit's difference
+  //a thousandfold every 40 or so steps
+  double err = 0.0;
+  for (int i = 0; i < 200; i++){
+    if (i % 10 == 0){
+      net->context->reset();
+      frozen.reset();
+    }
+    net->feed((*text)[i]);
+    frozen.feed((*text)[i]);
+    for (size_t j = 0; j < 95; j++)
+      err = max(err, (double) fabs(net->context->o[j] - frozen.probs()[j]));
+  }
+
+  size_t allocs = alloc_count;
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < steps; i++){
+    char c = pick_char(net->context->o);
+    net->feed(c);
+  }
+  double net_us = seconds_since(start) / steps * 1e6;
+  double net_allocs = (double) (alloc_count - allocs) / steps;
+
+  //steady state: everything is sized by the constructor, the output buffer by the caller
+  vector<char> out(steps);
+  frozen.seed(1);
+  frozen.generate(text->data(), 20, &out[0], 10);
+  allocs = alloc_count;
+  start = Clock::now();
+  frozen.generate(text->data(), 20, &out[0], steps);
+  double frozen_us = seconds_since(start) / (steps + 20) * 1e6;
+  size_t frozen_allocs = alloc_count - allocs;
+
+  double tol = (sizeof (real) == sizeof (double)) ? 1e-10 : 1e-4;
+  bool ok = err <= tol && frozen_allocs == 0;
+  printf("frozen    hidden=%-4zu training path %8.2f us/char %6.2f allocs/char   frozen %8.2f us/char %zu allocs in %d chars"
+         "  max error %.1e %s\n", hidden, net_us, net_allocs, frozen_us, frozen_allocs, steps, err, ok ? "ok" : "FAILED");
+  delete text;
+  delete net;
+  return ok;
+}
+
+/* Held-out perplexity of an inference copy, from its probability of each next character */
+static double perplexity(Frozen& frozen, const string& text){
+  frozen.reset();
+  double loss = 0.0;
+  size_t count = 0;
+  for (size_t i = 0; i + 1 < text.length(); i++){
+    frozen.feed(text[i]);
+    int next = char_index(text[i + 1]);
+    if (next >= 0){
+      loss -= log(frozen.probs()[next]);
+      count++;
+    }
+  }
+  return exp(loss / count);
+}
+
+static size_t file_size(const string& fname){
+  ifstream in(fname.c_str(), ios::binary | ios::ate);
+  return in.tellg();
+}
+
+/*
+The VNNI product against the int8 weight product it stands for, relative to the largest
+output; the rounding of x to int8 is all that separates them
+*/
+template <class T>
+static double q8x8_error(const Kernels<T>* k, size_t rows, size_t cols){
+  vector<int8_t> q(rows * cols);
+  for (size_t i = 0; i < q.size(); i++)
+    q[i] = (int8_t) (rand() % 255 - 127);
+  vector<float> qs = random_vector<float>(rows, 0.01);
+  vector<T> x = random_vector<T>(cols, 1.0);
+  vector<T> o1(rows), o2(rows);
+  k->gemv_q8(q.data(), rows, cols, cols, qs.data(), x.data(), o1.data(), false);
+  k->gemv_q8x8(q.data(), rows, cols, cols, qs.data(), x.data(), o2.data(), false);
+  double top = 0.0;
+  for (size_t r = 0; r < rows; r++)
+    top = max(top, (double) fabs(o1[r]));
+  return max_error(o1, o2) / top;
+}
+
+/*
+Train a network, then compare inference from its full precision copy with int8 weights and
+with int8 weights and activations: held-out perplexity, bytes of weights, file size and
+time per generated character, each the best of three alternating runs
+The int8 file must load to the same predictions as the copy it was written from, and the
+quantized copies must generate without allocating
+*/
+static bool bench_quant(size_t hidden, int chars, const string& path){
+  string* text = synthetic_text(chars + 5001);
+  string held_out = text->substr(chars + 1);
+  srand(1);
+  Net* net = new Net(text, 2, 95, hidden, 10);
+  streambuf* old = cout.rdbuf(NULL);
+  net->train(0.1, 0.01, chars);
+  cout.rdbuf(old);
+  write_net(net, path);
+  size_t float_file = file_size(path);
+
+  const char* names[] = {"float", "int8 w", "int8 w+a"};
+  Frozen* frozen[] = {new Frozen(*net), new Frozen(*net, QUANT_WEIGHTS), new Frozen(*net, QUANT_ALL)};
+  string qpath = path + ".q8";
+  frozen[1]->write(qpath);
+  size_t quant_file = file_size(qpath);
+  Frozen loaded(qpath);
+  double load_err = 0.0;
+  frozen[1]->reset();
+  for (size_t i = 0; i < 200; i++){
+    frozen[1]->feed(held_out[i]);
+    loaded.feed(held_out[i]);
+    for (size_t j = 0; j < 95; j++)
+      load_err = max(load_err, (double) fabs(frozen[1]->probs()[j] - loaded.probs()[j]));
+  }
+  remove(path.c_str());
+  remove(qpath.c_str());
+
+  double ppl[3], us[3] = {1e30, 1e30, 1e30};
+  size_t allocs = 0;
+  int steps = 2000;
+  vector<char> out(steps);
+  for (int v = 0; v < 3; v++){
+    ppl[v] = perplexity(*frozen[v], held_out);
+    frozen[v]->seed(1);
+    frozen[v]->generate(held_out.data(), 20, &out[0], 10);
+  }
+  for (int rep = 0; rep < 3; rep++)
+    for (int v = 0; v < 3; v++){
+      size_t before = alloc_count;
+      Clock::time_point start = Clock::now();
+      frozen[v]->generate(held_out.data(), 20, &out[0], steps);
+      us[v] = min(us[v], seconds_since(start) / (steps + 20) * 1e6);
+      allocs += (v > 0) ? alloc_count - before : 0;
+    }
+
+  //int8 should cost a few percent of perplexity at most, judged only on a network that learned
+  //something, one beating a uniform guess over 95 characters, as the larger ones can diverge
+  bool ok = load_err == 0.0 && allocs == 0;
+  if (ppl[0] < 95)
+    ok = ok && ppl[1] < ppl[0] * 1.05 && ppl[2] < ppl[0] * 1.1;
+  printf("quant     hidden=%-4zu file %zu -> %zu bytes  loaded error %.1e  %zu allocs %s\n",
+         hidden, float_file, quant_file, load_err, allocs, ok ? "ok" : "FAILED");
+  for (int v = 0; v < 3; v++)
+    printf("quant     hidden=%-4zu %-8s %8zu bytes %8.2f us/char %5.2fx  perplexity %8.3f %+6.2f%%\n",
+           hidden, names[v], frozen[v]->weight_bytes(), us[v], us[0] / us[v], ppl[v], (ppl[v] / ppl[0] - 1) * 100);
+  for (Frozen* f : frozen)
+    delete f;
+  delete net;
+  return ok;
+}
+
+/* Largest difference between the predictions of two networks over the same text */
+static double prediction_error(Net* a, Net* b, const string& text){
+  double err = 0.0;
+  a->context->reset();
+  b->context->reset();
+  for (size_t i = 0; i < text.length(); i++){
+    a->feed(text[i]);
+    b->feed(text[i]);
+    err = max(err, max_error(a->context->o, b->context->o));
+  }
+  return err;
+}
+
+/*
+Save a network, then load it copied, mapped with its checksum checked and mapped without
+Loads must predict exactly as the original; a corrupted copy must be refused, and so must
+a forged header, even by a load that skips the checksum
+Returns false if any fails
+*/
+static bool bench_model(size_t hidden, const string& path){
+  Net* net = new Net(synthetic_text(2001), 2, 95, hidden, 10);
+  streambuf* old = cout.rdbuf(NULL);
+  net->train(0.1, 0.01, 2000);
+  cout.rdbuf(old);
+  string probe = synthetic_text(200)->substr(0, 200);
+
+  Clock::time_point start = Clock::now();
+  write_net(net, path);
+  double save = seconds_since(start);
+
+  bool ok = true;
+  const char* names[] = {"read", "map", "map-noverify"};
+  for (int i = 0; i < 3; i++){
+    start = Clock::now();
+    Net* copy = (i == 0) ? read_net(path) : map_net(path, i == 1);
+    double load = seconds_since(start);
+    double err = prediction_error(net, copy, probe);
+    bool shared = copy->block[0]->w.borrowed() && copy->output->w.borrowed();
+    bool pass = err == 0.0 && shared == (i > 0);
+    printf("model     hidden=%-4zu %-12s %8.3f ms  save %8.3f ms  weights %-6s  prediction error %g %s\n",
+           hidden, names[i], load * 1e3, save * 1e3, shared ? "shared" : "copied", err, pass ? "ok" : "FAILED");
+    ok = ok && pass;
+    delete copy;
+  }
+
+  //flip one weight bit and check that a verified load refuses it
+  {
+    fstream file (path, ios::in | ios::out | ios::binary);
+    file.seekg(-8, ios::end);
+    char c;
+    file.get(c);
+    file.seekp(-8, ios::end);
+    file.put(c ^ 1);
+  }
+  bool refused = false;
+  try {
+    delete read_net(path);
+  } catch (runtime_error& e){
+    refused = true;
+  }
+  printf("model     hidden=%-4zu corrupted file %s %s\n", hidden, refused ? "refused" : "accepted", refused ? "ok" : "FAILED");
+
+  //header fields at their offsets: no layers, a huge hidden or input size, no window
+  uint64_t forged[][2] = {{24, 0}, {40, 1ull << 40}, {32, 1ull << 62}, {48, 0}};
+  int tries = 0, refusals = 0;
+  for (auto& f : forged)
+    for (int verify = 0; verify < 2; verify++){
+      write_net(net, path);
+      {
+        fstream file (path, ios::in | ios::out | ios::binary);
+        file.seekp(f[0]);
+        file.write((const char*) &f[1], sizeof f[1]);
+      }
+      tries++;
+      try {
+        delete (verify ? read_net(path) : map_net(path, false));
+      } catch (runtime_error& e){
+        refusals++;
+      }
+    }
+  printf("model     hidden=%-4zu forged headers %d of %d refused %s\n", hidden, refusals, tries,
+         refusals == tries ? "ok" : "FAILED");
+  remove(path.c_str());
+  delete net;
+  return ok && refused && refusals == tries;
+}
+
+/*
+Training with background saves every few windows against training without
+Reports how long the training loop stalled per save and how long the writes took,
+then checks the final save reloads to the trained weights and cursor
+*/
+static bool bench_saves(size_t hidden, int chars, size_t every, const string& path){
+  double base = 0.0;
+  bool ok = true;
+  for (int saving = 0; saving < 2; saving++){
+    srand(1);
+    Net* net = new Net(synthetic_text(chars + 1), 2, 95, hidden, 10);
+    if (saving){
+      net->save_path = path;
+      net->save_every = every;
+    }
+    streambuf* old = cout.rdbuf(NULL);
+    Clock::time_point start = Clock::now();
+    net->train(0.1, 0.01, chars);
+    double rate = chars / seconds_since(start);
+    cout.rdbuf(old);
+    if (!saving){
+      base = rate;
+      delete net;
+      continue;
+    }
+
+    const SaveStats& st = net->save_stats;
+    Net* copy = read_net(path);
+    double err = prediction_error(net, copy, synthetic_text(200)->substr(0, 200));
+    bool pass = err == 0.0 && st.failed == 0 && copy->cursor.chars == (size_t) chars && copy->cursor.limit == (size_t) chars;
+    printf("saves     hidden=%-4zu every %zu steps: %zu saves %zu skipped  stall mean %8.1f us max %8.1f us  write mean %7.2f ms\n",
+           hidden, every, st.saves, st.skipped, 1e6 * st.stall_total / max(st.saves, (size_t) 1), 1e6 * st.stall_max,
+           1e3 * st.write_total / (st.saves + 1));
+    printf("saves     hidden=%-4zu %10.0f chars/s with saves, %10.0f without  reload %s\n", hidden, rate, base,
+           pass ? "ok" : "FAILED");
+    ok = ok && pass;
+    delete copy;
+    delete net;
+  }
+  remove(path.c_str());
+  return ok;
+}
+
+/* Peak resident memory in megabytes since the last reset_peak() */
+static double peak_mb(){
+  ifstream status("/proc/self/status");
+  string line;
+  while (getline(status, line))
+    if (line.compare(0, 6, "VmHWM:") == 0)
+      return atof(line.c_str() + 6) / 1024.0;
+  return 0.0;
+}
+
+static void reset_peak(){
+  ofstream("/proc/self/clear_refs") << "5";
+}
+
+/* Stream a corpus through four prefetched streams, returning MB/s and the growth in peak memory */
+static double stream_corpus(const Corpus* text, double& peak){
+  reset_peak();
+  double before = peak_mb();
+  Clock::time_point start = Clock::now();
+  size_t span = text->length() / 4;
+  const int* curr;
+  const int* next;
+  {
+    Prefetcher slices(text, 0, span, 4, 0, span);
+    for (size_t i = 0; i < span; i++)
+      slices.step(curr, next);
+  }
+  double rate = text->length() / 1048576.0 / seconds_since(start);
+  peak = peak_mb() - before;
+  return rate;
+}
+
+/*
+Streaming a corpus file and mapping its cache against loading it whole, as main used to,
+line by line into a string
+Writes mb megabytes of synthetic lines, checks the prefetched steps and the cache match the
+text, then reports the startup time, rate and peak memory of each way of reading it, and that
+training from the file or the cache gives the same weights as training from a string
+*/
+static bool bench_corpus(size_t mb, int chars, const string& path, const string& cache){
+  string* piece = synthetic_text(1 << 20);
+  for (size_t i = 79; i < piece->length(); i += 80)
+    (*piece)[i] = '\n';
+  {
+    ofstream out(path, ios::binary);
+    for (size_t i = 0; i < mb; i++)
+      out << *piece;
+  }
+  size_t bytes = mb << 20;
+
+  //a few streams across the start of the file, each target running into the next stream
+  Corpus file(path);
+  bool ok = file.length() == bytes;
+  const int* curr;
+  const int* next;
+  {
+    size_t base = 12345, span = 100000;
+    Prefetcher slices(&file, base, span, 4, 0, span);
+    for (size_t i = 0; i < span; i++){
+      slices.step(curr, next);
+      for (int k = 0; k < 4; k++){
+        size_t pos = base + k * span + i;
+        ok = ok && curr[k] == char_index((*piece)[pos]) && next[k] == char_index((*piece)[pos + 1]);
+      }
+    }
+  }
+
+  //the cache agrees with the text at windows all through it, the last running off the end
+  Clock::time_point start = Clock::now();
+  CorpusStats st = preprocess_corpus(path, cache);
+  double prep_s = seconds_since(start);
+  start = Clock::now();
+  Corpus* mapped = new Corpus(cache);
+  double open_s = seconds_since(start);
+  size_t lines = count(piece->begin(), piece->end(), '\n') * mb;
+  ok = ok && cache_current(cache, path) && mapped->stats() && st.length == bytes && st.unmapped == lines;
+  vector<int> a(5000), b(5000);
+  for (size_t w = 0; w <= 64; w++){
+    size_t pos = w * ((bytes - 1000) / 64);
+    file.encode(pos, a.size(), &a[0]);
+    mapped->encode(pos, b.size(), &b[0]);
+    ok = ok && a == b;
+  }
+
+  double stream_peak, cache_peak;
+  double stream_rate = stream_corpus(&file, stream_peak);
+  double cache_rate = stream_corpus(mapped, cache_peak);
+
+  reset_peak();
+  double before = peak_mb();
+  start = Clock::now();
+  {
+    string in;
+    ifstream infile(path);
+    string ln;
+    while (getline(infile, ln))
+      in += "\n" + ln;
+  }
+  double load_s = seconds_since(start);
+  double load_peak = peak_mb() - before;
+  printf("corpus    %zu MB loaded whole    startup %9.3f s   peak memory %+8.1f MB\n", mb, load_s, load_peak);
+  printf("corpus    %zu MB streamed        %8.0f MB/s   peak memory %+8.1f MB\n", mb, stream_rate, stream_peak);
+  printf("corpus    %zu MB cached in %.2f s  startup %9.6f s   %8.0f MB/s   peak memory %+8.1f MB\n",
+         mb, prep_s, open_s, cache_rate, cache_peak);
+
+  //training from a string, the file and the cache of the same text
+  double rates[3];
+  Net* nets[3];
+  for (int f = 0; f < 3; f++){
+    srand(1);
+    nets[f] = new Net(new string(piece->substr(0, chars + 1)), 2, 95, 64, 10);
+    if (f)
+      nets[f]->corpus = new Corpus(f == 1 ? path : cache);
+    streambuf* old = cout.rdbuf(NULL);
+    start = Clock::now();
+    nets[f]->train(0.1, 0.01, chars, 4, 1, SYNC);
+    rates[f] = chars / seconds_since(start);
+    cout.rdbuf(old);
+  }
+  bool same = prediction_error(nets[0], nets[1], piece->substr(0, 200)) == 0.0 &&
+              prediction_error(nets[0], nets[2], piece->substr(0, 200)) == 0.0;
+  printf("corpus    hidden=64   %10.0f chars/s from a string, %10.0f from the file, %10.0f from the cache  weights %s\n",
+         rates[0], rates[1], rates[2], same ? "match" : "DIFFER");
+  ok = ok && same;
+  printf("corpus    prefetched steps and cache %s\n", ok ? "ok" : "FAILED");
+  for (int f = 0; f < 3; f++)
+    delete nets[f];
+  delete mapped;
+  delete piece;
+  remove(path.c_str());
+  remove(cache.c_str());
+  return ok;
+}
+
+/* The q-th quantile of some values, which get sorted */
+static double percentile(vector<double>& v, double q){
+  if (v.empty())
+    return 0.0;
+  sort(v.begin(), v.end());
+  return v[min(v.size() - 1, (size_t) (q * v.size()))];
+}
+
+struct ServeRun {
+  double rate; //characters per second over the run
+  double batch; //mean sessions per step
+  vector<double> latency; //seconds, per request
+  vector<double> first; //seconds to the first character, per request
+  vector<string> out; //by id
+  PrefixStats prefix;
+};
+
+/*
+Drive an engine with requests arriving gap seconds apart, all at once when gap is 0
+Arrivals are submitted between steps, the engine sleeping only when it has nothing to do
+*/
+static ServeRun serve_load(Net* net, int capacity, const vector<string>& prompts, const vector<size_t>& lengths, 
+                           double gap, size_t cache = 0){
+  Engine engine(net, capacity, cache);
+  ServeRun run;
+  run.out.resize(prompts.size());
+  vector<Session> done;
+  size_t sent = 0, generated = 0;
+  Clock::time_point start = Clock::now();
+  while (run.latency.size() < prompts.size()){
+    double now = seconds_since(start);
+    while (sent < prompts.size() && sent * gap <= now){
+      engine.submit(prompts[sent], lengths[sent]);
+      sent++;
+    }
+    if (!engine.active() && !engine.waiting()){
+      this_thread::sleep_for(chrono::duration<double>(sent * gap - now));
+      continue;
+    }
+    engine.step(done);
+    for (const Session& s : done){
+      run.latency.push_back(s.latency);
+      run.first.push_back(s.first);
+      run.out[s.id] = s.out;
+      generated += s.out.length();
+    }
+    done.clear();
+  }
+  run.rate = generated / seconds_since(start);
+  run.batch = (double) engine.stats.occupancy / engine.stats.steps;
+  if (engine.prefixes())
+    run.prefix = engine.prefixes()->stats;
+  return run;
+}
+
+/*
+Load generator for the batched inference engine
+Requests have random prompt and output lengths; a burst of all of them at once is served at
+several batch sizes, then a steady stream at twice what one session at a time can keep up
+with, one session at a time and batched; every request must generate the same text however
+it was batched. Finally checks the line protocol through serve()
+*/
+static bool bench_serve(size_t hidden, int requests){
+  srand(1);
+  Net* net = new Net(synthetic_text(10), 2, 95, hidden, 10);
+  string* text = synthetic_text(100000);
+  vector<string> prompts;
+  vector<size_t> lengths;
+  unsigned int seed = 7;
+  for (int i = 0; i < requests; i++){
+    seed = seed * 1103515245 + 12345;
+    prompts.push_back(text->substr((seed >> 8) % 90000, 10 + (seed >> 4) % 31));
+    lengths.push_back(50 + (seed >> 12) % 101);
+  }
+
+  bool ok = true;
+  vector<string> alone;
+  double alone_rate = 0.0;
+  int sizes[] = {1, 8, 32, 64};
+  for (int c : sizes){
+    ServeRun run = serve_load(net, c, prompts, lengths, 0.0);
+    if (c == 1){
+      alone = run.out;
+      alone_rate = requests / percentile(run.latency, 1.0); //the last finishes as the burst does
+    }
+    ok = ok && run.out == alone;
+    printf("serve     hidden=%-4zu burst  sessions=%-3d %10.0f chars/s  mean batch %5.1f  latency p50 %8.1f ms p99 %8.1f ms\n",
+           hidden, c, run.rate, run.batch, 1e3 * percentile(run.latency, 0.5), 1e3 * percentile(run.latency, 0.99));
+  }
+  for (int c : {1, 64}){
+    ServeRun run = serve_load(net, c, prompts, lengths, 0.5 / alone_rate);
+    ok = ok && run.out == alone;
+    printf("serve     hidden=%-4zu steady sessions=%-3d %10.0f chars/s  mean batch %5.1f  latency p50 %8.1f ms p99 %8.1f ms\n",
+           hidden, c, run.rate, run.batch, 1e3 * percentile(run.latency, 0.5), 1e3 * percentile(run.latency, 0.99));
+  }
+
+  //the protocol: a reply per request by id, errors for the malformed, stats on request and at the end
+  istringstream in("30 " + prompts[0] + "\n40 " + prompts[1] + "\nnonsense\nstats\n0 abc\n20 " + prompts[2] + "\n");
+  ostringstream out;
+  serve(net, 8, 0, in, out);
+  istringstream replies(out.str());
+  string line;
+  int answered = 0, errors = 0, stats = 0;
+  while (getline(replies, line)){
+    istringstream r(line);
+    string first, latency, body;
+    r >> first;
+    if (first == "error")
+      errors++;
+    else if (first == "stats")
+      stats++;
+    else {
+      r >> latency;
+      r.get();
+      getline(r, body);
+      int id = atoi(first.c_str());
+      answered += (id >= 0 && id < 3 && body.length() == (size_t) (id == 0 ? 30 : id == 1 ? 40 : 20)) ? 1 : 0;
+    }
+  }
+  bool proto = answered == 3 && errors == 2 && stats == 2;
+  printf("serve     sessions generate the same text batched as alone %s, protocol %s\n", ok ? "ok" : "FAILED",
+         proto ? "ok" : "FAILED");
+  delete text;
+  delete net;
+  return ok && proto;
+}
+
+/*
+Prompts sharing a few long prefixes, served without a prefix cache, with a large one and with
+one small enough to evict; reports time to the first character and the cache counters, and
+checks the cache changes nothing generated
+Requests arrive far enough apart that the time to the first character is mostly feeding the prompt
+*/
+static bool bench_prefix(size_t hidden, int requests, int prefixes, size_t shared){
+  srand(1);
+  Net* net = new Net(synthetic_text(10), 2, 95, hidden, 10);
+  string* text = synthetic_text(100000);
+  vector<string> prompts;
+  vector<size_t> lengths;
+  unsigned int seed = 11;
+  for (int i = 0; i < requests; i++){
+    seed = seed * 1103515245 + 12345;
+    string head = text->substr((i % prefixes) * 1000, shared);
+    prompts.push_back(head + text->substr(50000 + (seed >> 8) % 40000, 5 + (seed >> 4) % 16));
+    lengths.push_back(20);
+  }
+
+  //paced at twice the time one uncached prompt takes, measured at the start
+  ServeRun probe = serve_load(net, 1, vector<string>(prompts.begin(), prompts.begin() + 4),
+                              vector<size_t>(lengths.begin(), lengths.begin() + 4), 0.0);
+  double gap = 2.0 * percentile(probe.latency, 1.0) / 4;
+
+  bool ok = true;
+  vector<string> plain;
+  size_t caps[] = {0, 64 << 20, 256 << 10};
+  for (size_t cap : caps){
+    ServeRun run = serve_load(net, 64, prompts, lengths, gap, cap);
+    if (!cap)
+      plain = run.out;
+    bool same = run.out == plain;
+    bool under = run.prefix.bytes <= cap;
+    ok = ok && same && under;
+    const PrefixStats& ps = run.prefix;
+    printf("prefix    hidden=%-4zu cache %7zu KB  first char p50 %7.2f ms p99 %7.2f ms  hits %5.1f%%  prompt skipped %5.1f%%"
+           "  %zu held %zu evicted %zu KB%s\n", hidden, cap >> 10, 1e3 * percentile(run.first, 0.5),
+           1e3 * percentile(run.first, 0.99), ps.lookups ? 100.0 * ps.hits / ps.lookups : 0.0,
+           100.0 * ps.skipped / (requests * (shared + 12.5)), ps.entries, ps.evicted, ps.bytes >> 10,
+           (same && under) ? "" : "  FAILED");
+  }
+  delete text;
+  delete net;
+  return ok;
+}
+
+/*
+Data-parallel training throughput for each thread count and way of combining gradients
+Efficiency is the speedup over one thread divided by the thread count
+*/
+static void bench_parallel(size_t hidden, int chars, int max_threads){
+  const char* names[] = {"sync", "hogwild"};
+  Combine modes[] = {SYNC, HOGWILD};
+  for (int m = 0; m < 2; m++){
+    double base = 0.0;
+    for (int threads = 1; threads <= max_threads; threads *= 2){
+      Net* net = new Net(synthetic_text(chars * threads + 1), 2, 95, hidden, 10);
+      streambuf* old = cout.rdbuf(NULL);
+      Clock::time_point start = Clock::now();
+      net->train(0.1, 0.01, chars * threads, 4, threads, modes[m]);
+      double rate = chars * threads / seconds_since(start);
+      cout.rdbuf(old);
+
+      if (threads == 1)
+        base = rate;
+      printf("parallel  hidden=%-4zu %-7s threads=%-3d %10.0f chars/s  efficiency %5.1f%%\n",
+             hidden, names[m], threads, rate, 100.0 * rate / (base * threads));
+      delete net;
+    }
+  }
+}
+
+/*
+Results of a suite run, one per benchmark, size and metric, kept to be written as JSON so
+runs can be compared between releases; lower marks the metrics where a rise is a regression
+*/
+struct Result {
+  string bench;
+  size_t hidden;
+  string metric;
+  double value;
+  bool lower;
+};
+
+static vector<Result> results;
+
+static void report(const string& bench, size_t hidden, const string& metric, double value, bool lower){
+  Result r = {bench, hidden, metric, value, lower};
+  results.push_back(r);
+  printf("suite     %-16s hidden=%-4zu %-12s %12.3f\n", bench.c_str(), hidden, metric.c_str(), value);
+}
+
+/*
+The pieces of a step at one size, each on its own: the matrix and vector operations behind
+the gates, a block's forward step and BPTT and the output layer
+The block timed is the upper one, taking the lower one's h as a dense input; its link to
+the output layer is cut while it is timed alone, and the complaint that makes silenced
+*/
+static void suite_layers(size_t n){
+  size_t g = 4 * n;
+  int reps = max(10, (int) (4000000 / (g * n)));
+  int vreps = max(1000, (int) (4000000 / g));
+  srand(1);
+  Matrix<real> m(n, g);
+  m.randomize();
+  vector<real> x = random_vector<real>(n, 1.0);
+  vector<real> a = random_vector<real>(g, 1.0), b = random_vector<real>(g, 1.0), out(g), y;
+  report("matrix_mul", n, "us", best_us([&](){ y = m * x; }, reps), true);
+  report("h_prod", n, "us", best_us([&](){ h_prod(a, b, out); }, vreps), true);
+  report("activate_sigmoid", n, "us", best_us([&](){ activate(a, out, SIGMOID); }, vreps), true);
+  report("activate_tanh", n, "us", best_us([&](){ activate(a, out, TANH); }, vreps), true);
+  report("outer", n, "us", best_us([&](){ m.add_outer(1e-6, a, x); }, reps), true);
+
+  Net* net = new Net(synthetic_text(1000), 2, 95, n, 10);
+  Context& ctx = *net->context;
+  Block* top = net->block[1];
+  Output* out_node = top->out_node;
+  top->out_node = NULL;
+  streambuf* old = cerr.rdbuf(NULL);
+  double forward = best_us([&](){ top->forward(ctx, NULL, ctx.h[0].data(), NULL, NULL); }, reps);
+  cerr.rdbuf(old);
+  top->out_node = out_node;
+  report("block_forward", n, "us", forward, true);
+  report("output_forward", n, "us", best_us([&](){ net->output->forward(ctx, NULL, ctx.h[1].data(), NULL); }, reps), true);
+
+  //a window is stepped for every backprop, as BPTT consumes it, but only the backprop is timed
+  string* text = synthetic_text(11);
+  int index[11];
+  for (int t = 0; t < 11; t++)
+    index[t] = char_index((*text)[t]);
+  TimeRange* range = new TimeRange(2, 10, 95, n, 1, 0);
+  double best = 1e30;
+  for (int rep = 0; rep < max(5, reps / 10); rep++){
+    for (int l = 0; l < 2; l++)
+      range->clear(l);
+    for (int t = 0; t < 10; t++)
+      net->step(range, &index[t], &index[t + 1]);
+    net->output->backprop(range, &index[10]);
+    Clock::time_point start = Clock::now();
+    top->backprop(range, 10);
+    best = min(best, seconds_since(start) / 10 * 1e6);
+  }
+  report("block_backprop", n, "us_per_step", best, true);
+  delete range;
+  delete text;
+  delete net;
+}
+
+/*
+Generation from a frozen copy, full precision and int8, timing every character on its own
+for the rate and the latency percentiles
+*/
+static void suite_generate(size_t n, int chars){
+  srand(1);
+  Net* net = new Net(synthetic_text(10), 2, 95, n, 10);
+  const char* names[] = {"generate", "generate_int8"};
+  Quantize modes[] = {QUANT_NONE, QUANT_ALL};
+  vector<double> latency(chars);
+  for (int v = 0; v < 2; v++){
+    Frozen frozen(*net, modes[v]);
+    frozen.seed(1);
+    frozen.feed('a');
+    for (int i = 0; i < 100; i++)
+      frozen.feed(frozen.sample());
+    Clock::time_point begin = Clock::now();
+    for (int i = 0; i < chars; i++){
+      Clock::time_point start = Clock::now();
+      frozen.feed(frozen.sample());
+      latency[i] = seconds_since(start) * 1e6;
+    }
+    double total = seconds_since(begin);
+    report(names[v], n, "chars_per_s", chars / total, false);
+    report(names[v], n, "p50_us", percentile(latency, 0.5), true);
+    report(names[v], n, "p90_us", percentile(latency, 0.9), true);
+    report(names[v], n, "p99_us", percentile(latency, 0.99), true);
+  }
+  delete net;
+}
+
+/* Every result with what it was run on, a result per line */
+static bool write_json(const string& path){
+  FILE* f = fopen(path.c_str(), "w");
+  if (!f){
+    fprintf(stderr, "Could not write %s\n", path.c_str());
+    return false;
+  }
+  fprintf(f, "{\n  \"isa\": \"%s\",\n  \"precision\": \"%s\",\n  \"accuracy\": \"%s\",\n  \"threads\": %u,\n",
+          kernels<real>().name, precision_name(), accuracy_name(accuracy()), thread::hardware_concurrency());
+  fprintf(f, "  \"results\": [\n");
+  for (size_t i = 0; i < results.size(); i++){
+    const Result& r = results[i];
+    fprintf(f, "    {\"bench\": \"%s\", \"hidden\": %zu, \"metric\": \"%s\", \"value\": %.6g, \"lower_is_better\": %s}%s\n",
+            r.bench.c_str(), r.hidden, r.metric.c_str(), r.value, r.lower ? "true" : "false",
+            (i + 1 < results.size()) ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  return fclose(f) == 0;
+}
+
+/*
+The suite: the pieces of a step, training and generation at every size, written to a JSON
+file as well as printed
+*/
+static bool bench_suite(const string& path){
+  size_t sizes[] = {32, 64, 128, 256};
+  for (size_t n : sizes)
+    suite_layers(n);
+  for (size_t n : sizes){
+    report("train", n, "chars_per_s", bench_train(n, 1000, 1, 10), false);
+    report("train_16_streams", n, "chars_per_s", bench_train(n, 8000, 16, 10), false);
+  }
+  for (size_t n : sizes)
+    suite_generate(n, 2000);
+  if (!write_json(path))
+    return false;
+  printf("suite     %zu results written to %s\n", results.size(), path.c_str());
+  return true;
+}
+
+/* Results read back from a file written by write_json, keyed by benchmark, size and metric */
+static bool read_json(const string& path, vector<Result>& out){
+  ifstream in(path.c_str());
+  if (!in){
+    fprintf(stderr, "Could not read %s\n", path.c_str());
+    return false;
+  }
+  string line;
+  while (getline(in, line)){
+    char bench[64], metric[32], lower[8];
+    Result r;
+    if (sscanf(line.c_str(), " {\"bench\": \"%63[^\"]\", \"hidden\": %zu, \"metric\": \"%31[^\"]\", \"value\": %lf, \"lower_is_better\": %7[a-z]",
+               bench, &r.hidden, metric, &r.value, lower) == 5){
+      r.bench = bench;
+      r.metric = metric;
+      r.lower = string(lower) == "true";
+      out.push_back(r);
+    }
+  }
+  return true;
+}
+
+/*
+Compare two suite runs, listing every metric that got worse by more than tolerance percent
+Returns false when any did
+*/
+static bool bench_compare(const string& before, const string& after, double tolerance){
+  vector<Result> a, b;
+  if (!read_json(before, a) || !read_json(after, b))
+    return false;
+  int worse = 0, compared = 0;
+  for (const Result& r : b)
+    for (const Result& o : a){
+      if (o.bench != r.bench || o.hidden != r.hidden || o.metric != r.metric || o.value <= 0)
+        continue;
+      double change = (r.value / o.value - 1) * 100;
+      bool regressed = r.lower ? change > tolerance : change < -tolerance;
+      compared++;
+      if (regressed){
+        worse++;
+        printf("compare   %-16s hidden=%-4zu %-12s %12.3f -> %12.3f %+7.1f%% REGRESSED\n",
+               r.bench.c_str(), r.hidden, r.metric.c_str(), o.value, r.value, change);
+      }
+    }
+  printf("compare   %d of %d metrics worse by more than %.0f%%\n", worse, compared, tolerance);
+  return worse == 0;
+}
+
+int main(int argc, char** argv){
+  if (argc > 1 && string(argv[1]) == "suite")
+    return bench_suite((argc > 2) ? argv[2] : "bench.json") ? 0 : 1;
+  if (argc > 3 && string(argv[1]) == "compare")
+    return bench_compare(argv[2], argv[3], (argc > 4) ? atof(argv[4]) : 20.0) ? 0 : 1;
+  if (argc > 1 && string(argv[1]) == "precision"){
+    size_t sizes[] = {64, 256};
+    for (size_t n : sizes)
+      bench_precision(n, 20000);
+    return 0;
+  }
+  if (argc > 1 && string(argv[1]) == "model")
+    return (bench_model(64, "bench_model.rnn") && bench_model(256, "bench_model.rnn")) ? 0 : 1;
+  if (argc > 1 && string(argv[1]) == "saves")
+    return (bench_saves(64, 20000, 100, "bench_saves.rnn") && bench_saves(256, 4000, 100, "bench_saves.rnn")) ? 0 : 1;
+  if (argc > 1 && string(argv[1]) == "corpus")
+    return bench_corpus(1024, 20000, "bench_corpus.txt", "bench_corpus.idx") ? 0 : 1;
+  if (argc > 1 && string(argv[1]) == "serve")
+    return (bench_serve(128, 256) && bench_prefix(128, 96, 8, 200)) ? 0 : 1;
+  if (argc > 1 && string(argv[1]) == "frozen"){
+    bool ok = true;
+    for (size_t n : {32, 64, 128, 256})
+      ok = bench_frozen(n, 2000) && ok;
+    return ok ? 0 : 1;
+  }
+  if (argc > 1 && string(argv[1]) == "beam")
+    return (bench_beam(64, 200) && bench_beam(128, 200)) ? 0 : 1;
+  if (argc > 1 && string(argv[1]) == "sampler")
+    return bench_sampler(200000) ? 0 : 1;
+  if (argc > 1 && string(argv[1]) == "fixed"){
+    bool ok = true;
+    for (size_t n : {64, 100, 128, 256})
+      ok = bench_fixed(n, 2000, 64) && ok;
+    return ok ? 0 : 1;
+  }
+  if (argc > 1 && string(argv[1]) == "quant"){
+    bool ok = true;
+    const Kernels<real>* k = &kernels<real>();
+    if (k->gemv_q8x8)
+      printf("quant     %s VNNI product relative error %.2e\n", k->name, q8x8_error(k, 512, 257));
+    for (size_t n : {64, 128, 256})
+      ok = bench_quant(n, 20000, "bench_quant.rnn") && ok;
+    return ok ? 0 : 1;
+  }
+  if (argc > 1 && string(argv[1]) == "bptt")
+    return bench_checkpoint(128, 4) ? 0 : 1;
+  if (argc > 1 && string(argv[1]) == "accuracy"){
+    bool ok = bench_tiers<double>("double", 4096, 200);
+    ok = bench_tiers<float>("float", 4096, 200) && ok;
+    bench_accuracy(64, 20000);
+    return ok ? 0 : 1;
+  }
+
+  bool ok = check_kernels<double>("double", 1e-9);
+  ok = check_kernels<float>("float", 1e-4) && ok;
+  printf("kernels   dispatch picked %s\n", kernels<double>().name);
+  bench_kernels<double>("double", 256, 200);
+  bench_kernels<float>("float", 256, 200);
+  ok = bench_tiers<double>("double", 4096, 200) && ok;
+  ok = bench_tiers<float>("float", 4096, 200) && ok;
+  bench_accuracy(64, 20000);
+
+  size_t sizes[] = {32, 64, 128, 256};
+  for (size_t n : sizes)
+    bench_forward(n, 2000);
+  for (size_t n : sizes)
+    ok = bench_frozen(n, 2000) && ok;
+  for (size_t n : {64, 100, 128, 256})
+    ok = bench_fixed(n, 2000, 64) && ok;
+  ok = bench_sampler(200000) && ok;
+  ok = bench_beam(64, 200) && bench_beam(128, 200) && ok;
+  for (size_t n : {64, 128, 256})
+    ok = bench_quant(n, 20000, "bench_quant.rnn") && ok;
+  int streams[] = {1, 4, 16};
+  for (size_t n : sizes)
+    for (int k : streams)
+      bench_train(n, 500 * k, k, 10);
+  for (int k : streams)
+    bench_train(128, 1000 * k, k, 50);
+
+  ok = bench_checkpoint(128, 4) && ok;
+  ok = bench_model(64, "bench_model.rnn") && ok;
+  ok = bench_model(256, "bench_model.rnn") && ok;
+  ok = bench_saves(64, 20000, 100, "bench_saves.rnn") && ok;
+  ok = bench_saves(256, 4000, 100, "bench_saves.rnn") && ok;
+  ok = bench_corpus(64, 20000, "bench_corpus.txt", "bench_corpus.idx") && ok;
+  ok = bench_serve(128, 256) && ok;
+  ok = bench_prefix(128, 96, 8, 200) && ok;
+
+  int cores = thread::hardware_concurrency();
+  printf("parallel  %d hardware threads\n", cores);
+  bench_parallel(128, 4000, max(4, cores));
+  return ok ? 0 : 1;
+}
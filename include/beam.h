@@ -0,0 +1,34 @@
+/*******************************************************************************
+ * Name        : beam.h
+ * Author      : Ben Blease
+ * Date        : 11/13/17
+ * Description : Beam search decoding over a batch of forked states
+ ******************************************************************************/
+
+#ifndef BEAM_H_
+#define BEAM_H_
+
+#include <string>
+#include <vector>
+#include "core.h"
+
+/* A generated continuation and how likely the network finds it */
+struct Beam {
+  std::string text; //without the prompt
+  double score; //sum of the log-probabilities of its characters
+};
+
+/*
+Beam search: each step extends every beam by every character and keeps the width best by
+score, so beams fork from shared ancestors and die out
+The beams are the rows of one Context, stepped together by one batched product per weight
+matrix; a forked row copies its parent's h and state for every layer
+Returns the beams best first
+net - network to run, only read
+prompt - fed once from a clear state before the beams fork
+length - characters to generate
+width - beams kept
+*/
+std::vector<Beam> beam_search(Net*, const std::string&, size_t, int);
+
+#endif /* beam.h */
@@ -0,0 +1,74 @@
+/*******************************************************************************
+ * Name        : checkpoint.h
+ * Author      : Ben Blease
+ * Date        : 11/2/17
+ * Description : Background saves of a network while it trains
+ ******************************************************************************/
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "core.h"
+
+#define WRITER_NICE 10
+
+/*
+Saves a training network on a background thread, every so many steps or seconds
+Taking a save hands the network to the thread, which copies the weights and cursor
+into a file image, then checksums, writes, fsyncs and renames it; if the training
+loop is about to change the weights before the thread has started the copy, it
+makes the copy itself
+A save that comes due while the last is still being written is skipped
+*/
+class Checkpointer {
+public:
+  SaveStats stats;
+
+  /* Save if one is due after this many steps */
+  void tick(Net*, size_t);
+
+  /* Hand the network over for writing, false when skipped */
+  bool take(Net*);
+
+  /* Wait until the network last taken has been copied, before changing its weights */
+  void settle();
+
+  /* Wait for the write in progress */
+  void flush();
+
+  Checkpointer(const std::string&, size_t, double);
+
+  /* Finishes the write in progress */
+  ~Checkpointer();
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  std::string path;
+  size_t every;
+  double seconds;
+  size_t last_step;
+  Clock::time_point last_time;
+
+  std::vector<char> image;
+  Net* source; //network taken but not yet claimed for copying into image
+  bool copying; //image is being filled, by the thread or by settle
+  bool pending; //image holds a save the thread has not finished
+  bool owed; //the last save's stall is still open, until it is settled
+  double stall; //of the last save so far, seconds
+  bool stop;
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread writer;
+
+  void run();
+  void claim(std::unique_lock<std::mutex>&);
+};
+
+#endif /* checkpoint.h */
@@ -11,8 +11,8 @@
 #include <iostream>
 #include <vector>
 #include <string>
-#include <deque>
 #include "serialized.h"
+#include "sampler.h"
 
 //rnn.cpp
 enum Gates{
@@ -23,6 +23,47 @@ enum Gates{
 	C //state
 };
 
+/*
+Recurrent state of every layer for a number of streams advancing in lockstep
+Per-layer vectors hold one row per stream, so stream k's hidden output is h[l][k * n, (k + 1) * n)
+A forward pass only writes to its Context, so the weights can be shared
+*/
+struct Context {
+  int streams;
+  std::vector<std::vector<real> > h; //hidden output
+  std::vector<std::vector<real> > state; //cell state
+  std::vector<std::vector<real> > pre; //gate pre-activations, scratch
+  std::vector<std::vector<real> > act; //gate activations, scratch
+  std::vector<real> o; //output distribution
+  double loss; //cross-entropy summed over every prediction with a target
+  size_t scored; //predictions in loss
+
+  /* Zero the state of every stream */
+  void reset();
+
+  /* Mean cross-entropy in nats per character since the last call */
+  double take_loss();
+
+  Context(size_t, size_t, size_t, int);
+};
+
+/*
+Weight gradients of one layer summed over a BPTT window, in accum precision
+w and u have one row per weight row; the output layer leaves u empty
+*/
+struct Gradient {
+  Matrix<accum> w;
+  Matrix<accum> u;
+  std::vector<accum> b;
+
+  void clear();
+
+  /* Sum in the gradient of another worker */
+  Gradient& operator+=(const Gradient&);
+
+  Gradient(size_t, size_t, size_t, size_t);
+};
+
 /* 
 Store information of a specific time step
 Stores:
@@ -30,64 +71,123 @@ Stores:
   - Gate output
   - Deltas
   - Delta from next layer
+Gate data is stacked z i f o (n entries each), matching the stacked weights
+Every field holds one row per stream, and points into the slab of its TimeRange
 */
 struct TimeStep{
-  //z i f o
-  //n dimensional
-  std::vector<std::vector<double> > gates;
-  std::vector<std::vector<double> > inputs;
-  std::vector<double> input;
-  std::vector<double> output; //output at the current time step
-  std::vector<double> state;
-  std::vector<std::vector<double> > dels; //z i f o c
-  std::vector<double> del_x;
- 
-
-  void set_delts(std::vector<double>, std::vector<double>, std::vector<double>, std::vector<double>, std::vector<double>);
-
-  TimeStep(std::vector<std::vector<double> >, std::vector<std::vector<double> >, std::vector<double>, std::vector<double>, std::vector<double>, int);
-
-  ~TimeStep() { }
+  real* gates; //4n activations
+  real* inputs; //4n pre-activations
+  real* input; //dense input, unused when index is set
+  real* output; //output at the current time step
+  real* state;
+  int* index; //one-hot input index per stream
+  bool sparse; //the input was given by index
+  real* dels; //5n, z i f o c
+  real* del_x; //delta from the layer above, zero until it is filled
+};
 
+/*
+Storage for every time step a layer can hold, allocated once
+Slot t of a field starts at t times its per-step size
+*/
+struct Slab {
+  std::vector<real> gates;
+  std::vector<real> inputs;
+  std::vector<real> input;
+  std::vector<real> output;
+  std::vector<real> state;
+  std::vector<int> index;
+  std::vector<real> dels;
+  std::vector<real> del_x;
+  std::vector<TimeStep> step; //view of each slot
+
+  Slab(int, size_t, size_t, int);
 };
 
 /*
 Store all needed information about a time step and the current machine state for backpropagation through time
-Stores deques for an arbitrary number of layers
+Each layer keeps a fixed ring of max_size steps, so pushing never allocates;
+alongside are the state of the streams being trained and the gradients they produce,
+so each training worker owns one
+
+With a checkpoint interval the ring only holds one segment of interval steps plus
+the step after it; the window is kept as the inputs and targets of every step and
+the recurrent state every interval steps, and each segment is recomputed from its
+checkpoint during backprop
 */
 struct TimeRange{
   int max_size;
-  std::vector<std::deque<TimeStep> > q;
-
-  /* Push a timestep onto the deque */
-  void push(int, TimeStep);
+  int window; //steps per BPTT window
+  int interval; //steps between checkpoints, 0 keeps every step
+  int streams;
+  Context ctx;
+  Context replay; //recomputes segments from their checkpoints
+  std::vector<Slab> slab; //per layer
+  std::vector<int> head; //slot of the oldest step per layer
+  std::vector<int> count; //steps held per layer
+  std::vector<Gradient> grad; //per layer, then the output layer
+
+  //checkpointed windows
+  int fed; //steps recorded since the last backprop
+  std::vector<int> log_index; //input of every step and stream
+  std::vector<int> log_target; //target of every step and stream
+  std::vector<std::vector<real> > ckpt_h; //per layer, h before every interval-th step
+  std::vector<std::vector<real> > ckpt_state; //per layer, state before every interval-th step
+  std::vector<std::vector<real> > carry_dels; //per layer, deltas of the first step of the later segment
+  std::vector<std::vector<real> > carry_gates;
+
+  //backprop scratch, sized once for the widest layer
+  std::vector<real> del_y;
+  std::vector<real> tmp;
+  std::vector<real> zero;
+  std::vector<const real*> entry; //per layer, state before the first held step
+  std::vector<accum> wide_del;
+  std::vector<accum> wide_x;
+
+  /* Claim the next step of layer l, dropping the oldest when full; its deltas start zeroed */
+  TimeStep* push(int);
+
+  /* Log the inputs and targets of the next step, checkpointing the context when one is due */
+  void record(const int*, const int*);
+
+  /* Drop every step held, as at the end of a window or the start of a training run */
+  void restart();
+
+  /* Bytes held, counting every buffer */
+  size_t bytes() const;
+
+  /* Bytes a TimeRange built with these arguments would hold, without building it */
+  static size_t footprint(int, int, size_t, size_t, int, int);
 
   /* Return the pointer of a timestep at index i */
   inline TimeStep* get (int l, int i){
-    if (l >= q.size())
-      return NULL;
-    return &(q[l][i]);
+    return &slab[l].step[(head[l] + i) % max_size];
   }
 
   /* Return the pointer of the last timestep */
   inline TimeStep* back (int l){
-    return &(q[l].back());
+    return get(l, count[l] - 1);
+  }
+
+  /* Steps from index i that sit in consecutive slots, up to the end of the ring */
+  inline int contiguous(int l, int i){
+    return max_size - (head[l] + i) % max_size;
   }
 
   inline void clear(int l){
-    q[l].clear();
+    head[l] = 0;
+    count[l] = 0;
   }
 
   inline int size(int l){
-  	return q[l].size();
+  	return count[l];
   }
 
-  TimeRange(int l_num, int s): max_size(s), q(std::vector<std::deque<TimeStep> >(l_num)) { }
-
-  ~TimeRange() { 
-    for(std::deque<TimeStep> d : q)
-    	d.clear();
+  inline int layers(){
+    return slab.size();
   }
+
+  TimeRange(int, int, size_t, size_t, int, int);
 };
 
 /*
@@ -99,26 +199,30 @@ struct Output {
   size_t inp_size;
   size_t block_num;
 
-  std::vector<double> x;
-  Matrix<double> w;
-  std::vector<double> b;
-  std::vector<double> o;
+  Matrix<real> w;
+  std::vector<real> b;
 
-  Matrix<double> calc_delta(std::vector<double>);
+  /*
+  Softmax for every stream into ctx.o, adding the cross-entropy of any targets to the context
+  Training passes also store the delta of the top layer
+  */
+  void forward(Context&, TimeRange*, const real*, const int*);
 
-  void forward(TimeRange*, std::vector<double>*);
+  /* Gradient from the last step of every stream against one target index per stream */
+  void backprop(TimeRange*, const int*);
 
-  void backprop(std::vector<double>, double, double);
+  /* Apply a gradient summed over a number of streams */
+  void apply(const Gradient&, double, double, int);
 
-  Output(size_t, size_t);
+  /* Weights start random unless told they are about to be loaded */
+  Output(size_t, size_t, bool = true);
 
   ~Output();
 };
 
 /*
  LSTM memory block encapsulating and modifying a memory cell
- TODO allow for multiple chained memory blocks
- - Contain all block data as vectors; should only be minor changes
+ State lives in the Context passed through, the block only holds weights
 */
 struct Block {
   int id;
@@ -127,49 +231,120 @@ struct Block {
 
   size_t inp_size;
   size_t block_num;
+  int shape; //index of the fixed size kernels for a batch of streams, -1 for the generic ones
+
+  //all four gates stacked z i f o, so one product covers every gate
+  Matrix<real> w; //input weight (4N x M)
+  Matrix<real> u; //chaining weight (4N x N)
+  std::vector<real> b; //block biases (4N)
+  Matrix<real> wt; //transposed w (M x 4N) of the first block, whose one-hot input reads a character's weights as one row
 
-  //sideways shift
-  std::vector<double> x; //central input
-  std::vector<double> h; //input from t - 1 block
-  std::vector<double> state;
-  std::vector<double> state_prev;
-  
-  //f, i, o, z
-  Matrix<double> w[4]; //input weight (N x M)
-  Matrix<double> u[4]; //chaining weight (N x N)
-  std::vector<double> b[4]; //block biases
+  /* Rows of w/u belonging to gate g */
+  MatrixView<real> gate_w(int);
 
-  void forward(TimeRange*, std::vector<double>*);
+  MatrixView<real> gate_u(int);
 
-  void backprop(TimeRange*, int, double, double);
+  /* Copy w into wt, after anything that changes w */
+  void transpose_input();
 
-  Block(int, size_t, size_t);
+  /*
+  Step every stream of the context
+  Input is either dense rows (M per stream) or one-hot indices, the other is NULL
+  */
+  void forward(Context&, TimeRange*, const real*, const int*, const int*);
+
+  /*
+  BPTT over the held steps, adding the weight gradient to the one in the TimeRange
+  The last held step only carries deltas in from later steps
+  */
+  void backprop(TimeRange*, int);
+
+  /* Apply a gradient summed over a number of streams */
+  void apply(const Gradient&, double, double, int);
+
+  /* Weights start random unless told they are about to be loaded */
+  Block(int, size_t, size_t, bool = true);
 
   ~Block();
 };
 
 /*
  Encapsulates all 95 nodes for ASCII characters
+ Targets, when given, are the expected next character index of each stream
 */
 struct Input {
   Block* next;
 
-  void forward(TimeRange*, std::vector<double>, std::vector<double>*);
+  /* Dense input, one row of s entries per stream */
+  void forward(Context&, TimeRange*, const std::vector<real>&, const int*);
+
+  /* One-hot input per stream given by index; the first block gathers weight columns instead of a GEMM */
+  void forward(Context&, TimeRange*, const int*, const int*);
 
   Input();
 
   ~Input();
 };
 
+/* A file mapped read-only, for weights used in place */
+struct Mapping {
+  const char* addr;
+  size_t size;
+
+  Mapping(const std::string&);
+
+  ~Mapping();
+
+private:
+  Mapping(const Mapping&);
+  Mapping& operator=(const Mapping&);
+};
+
+/* Where a training run is, saved with the weights so that it can resume */
+struct TrainCursor {
+  size_t step; //steps every stream has taken
+  size_t chars; //characters trained on
+  size_t limit; //of the run
+  double rate;
+  double lambda;
+  int streams;
+  int threads;
+
+  TrainCursor(): step(0), chars(0), limit(0), rate(0), lambda(0), streams(0), threads(0) { }
+};
+
+/* Background saves of a training run; a stall is the time the training loop waited for one */
+struct SaveStats {
+  size_t saves;
+  size_t skipped; //due while the previous save was still being written
+  size_t failed;
+  double stall_total; //seconds
+  double stall_max;
+  double write_total; //seconds spent writing in the background
+
+  SaveStats(): saves(0), skipped(0), failed(0), stall_total(0), stall_max(0), write_total(0) { }
+};
+
+/* How the gradients of parallel training workers are combined */
+enum Combine {
+  SYNC, //summed, then applied once per BPTT window
+  HOGWILD //applied by each worker as soon as it has them, without locking
+};
+
+class Corpus;
+
 /*
 Recurrent Neural Network
 */
 struct Net {
-  TimeRange* time_vals; //network information for each time step
+  std::vector<TimeRange*> time_vals; //network information for each time step, one per training worker
+  Context* context; //single stream state for running the network
   Input* input; //input provides entrance into network
   std::vector<Block*> block; //blocks can be chained
   Output* output;
   std::string* data;
+  Corpus* corpus; //training text streamed from a file instead of data, NULL to train on data
+  Mapping* mapping; //save file the weights point into, NULL when they are owned
 
   //network information
   size_t layer_num;
@@ -177,32 +352,90 @@ struct Net {
   size_t node_num;
 
   int block_size;
+  int checkpoint; //steps between BPTT checkpoints in training, 0 keeps every step
   bool trained;
 
+  TrainCursor cursor; //progress of the current or last training run
+
+  //saves in the background while training, with a last one at the end; none while save_path is empty
+  std::string save_path;
+  size_t save_every; //steps between saves, 0 for none
+  double save_seconds; //seconds between saves, 0 for none
+  SaveStats save_stats; //of the last training run
+
+  /* One training step of every stream of a TimeRange, indices and targets given per stream */
+  void step(TimeRange*, const int*, const int*);
+
+  /* BPTT over the window held by a TimeRange, leaving every gradient in it; y is the last input of each stream */
+  void backprop(TimeRange*, const int*);
+
+  /*
+  Largest checkpoint interval whose BPTT memory per training worker fits a budget in bytes,
+  0 when every step fits; throws when nothing does
+  */
+  int plan_checkpoint(size_t, int);
+
   /*
   Train the network on the input data
   */
-  void train(double, double, int);
+  void train(double, double, size_t);
 
   /*
-  Run the trained network
+  Train on the input data split into a number of streams advancing in lockstep
+  Each step is then a matrix-matrix product over all streams
   */
-  std::string run(size_t, std::string);
+  void train(double, double, size_t, int);
 
-  Net(std::string*, size_t, size_t, size_t, int);
+  /*
+  Data-parallel training: every thread runs its own streams over its own shard of the data
+  against the shared weights, combining gradients as chosen
+  A run with the same limit and layout as the cursor's resumes where it stopped
+  */
+  void train(double, double, size_t, int, int, Combine);
+
+  /*
+  Feed one character through the running context, the prediction is left in context->o
+  */
+  void feed(char);
+
+  /*
+  Pick the fixed size kernels for the shape of the network when they are built, or go back
+  to the generic ones; done when the network is built or loaded
+  */
+  void specialize(bool = true);
+
+  /*
+  Run the trained network from a seed string, on an inference-only copy of it (Frozen),
+  drawing characters as the sampling parameters say
+  */
+  std::string run(size_t, std::string, const SampleParams& = SampleParams());
+
+  /* Weights start random unless told they are about to be loaded */
+  Net(std::string*, size_t, size_t, size_t, int, bool = true);
 
   ~Net();
 };
 
 //io.cpp
-std::vector<double> vectorize(char);
+std::vector<real> vectorize(char);
 
-char pick_char(const std::vector<double>&);
+int char_index(char);
 
-char max_pick_char(const std::vector<double>&);
+char pick_char(const std::vector<real>&);
+
+char max_pick_char(const std::vector<real>&);
+
+//rw.cpp
+/* Lay out the save file of a network in a buffer, reusing its storage */
+void net_image(Net*, std::vector<char>&);
+
+/* Checksum and write a buffer from net_image, forced to disk when asked */
+void write_image(std::vector<char>&, std::string, bool);
 
 void write_net(Net*, std::string);
 
 Net* read_net(std::string);
 
+Net* map_net(std::string, bool = true);
+
 #endif /* core.h */
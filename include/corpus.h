@@ -0,0 +1,132 @@
+/*******************************************************************************
+ * Name        : corpus.h
+ * Author      : Ben Blease
+ * Date        : 11/4/17
+ * Description : Training text streamed from disk and encoded ahead of use
+ ******************************************************************************/
+
+#ifndef CORPUS_H_
+#define CORPUS_H_
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+#define PREFETCH_STEPS 4096 //steps encoded per chunk
+#define PREFETCH_DEPTH 3 //chunks held per worker, the one in use included
+
+#define CORPUS_NONE 255 //cached byte of a character without an index
+
+struct Mapping;
+
+/* Counts taken while caching a corpus */
+struct CorpusStats {
+  uint64_t length; //characters
+  uint64_t unmapped; //characters without an index, trained on as neither input nor target
+  uint64_t counts[256]; //of each index
+};
+
+/*
+Training text: a text file read a piece at a time, a cache made by preprocess_corpus and
+mapped whole, or a string already in memory
+Positions past the end have no index
+*/
+class Corpus {
+public:
+  size_t length() const { return size; }
+
+  /* Character indices from a position on, -1 where there is none */
+  void encode(size_t, size_t, int*) const;
+
+  /*
+  Done with the characters from a position on for now; a mapped cache lets go of their pages,
+  which stay in the page cache for other runs, so streaming through it holds little memory
+  */
+  void release(size_t, size_t) const;
+
+  /* Counts from the cache, NULL for text */
+  const CorpusStats* stats() const { return codes ? &cached : NULL; }
+
+  /* A text file or a cache of one, told apart by the cache's header; either can be of any size */
+  explicit Corpus(const std::string&);
+
+  /* A string, which must outlive the corpus */
+  explicit Corpus(const std::string*);
+
+  ~Corpus();
+
+private:
+  int fd; //text file, -1 otherwise
+  const std::string* text;
+  Mapping* map; //cache file
+  const unsigned char* codes; //indices in the cache
+  size_t size;
+  int index[256]; //of each stored byte
+  CorpusStats cached;
+
+  Corpus(const Corpus&);
+  Corpus& operator=(const Corpus&);
+};
+
+/*
+Encode a text file once into a cache of one index byte per character, after a header of
+the vocabulary and counts, so later runs map it rather than reading and encoding the text
+*/
+CorpusStats preprocess_corpus(const std::string&, const std::string&);
+
+/* Whether a cache exists and was made from the text file as it is now */
+bool cache_current(const std::string&, const std::string&);
+
+/*
+Encodes the character indices of a training worker's streams on a background thread,
+a few chunks ahead of the worker, so reading and encoding overlap with training
+Stream k covers the span characters from base + k * span, its targets running one past
+*/
+class Prefetcher {
+public:
+  /* Indices of the next step and their targets, one per stream; valid until the next call */
+  void step(const int*&, const int*&);
+
+  /*
+  c - text to read
+  base - position of the first stream
+  span - characters per stream
+  k - the number of streams
+  first, last - steps to encode
+  */
+  Prefetcher(const Corpus*, size_t, size_t, int, size_t, size_t);
+
+  ~Prefetcher();
+
+private:
+  //step major, the indices of every stream at one step together
+  struct Chunk {
+    std::vector<int> curr;
+    std::vector<int> next;
+    size_t steps;
+  };
+
+  const Corpus* corpus;
+  size_t base;
+  size_t span;
+  int streams;
+  size_t first;
+  size_t last;
+
+  Chunk ring[PREFETCH_DEPTH];
+  size_t filled; //chunks encoded so far
+  size_t used; //chunks the worker is done with
+  size_t pos; //next step within the chunk in use
+  bool stop;
+  std::string error; //from the thread, rethrown to the worker
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread reader;
+
+  void run();
+};
+
+#endif /* corpus.h */
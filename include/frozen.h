@@ -0,0 +1,122 @@
+/*******************************************************************************
+ * Name        : frozen.h
+ * Author      : Ben Blease
+ * Date        : 11/10/17
+ * Description : Inference-only copy of a trained network
+ ******************************************************************************/
+
+#ifndef FROZEN_H_
+#define FROZEN_H_
+
+#include <string>
+#include <vector>
+#include <random>
+#include "core.h"
+#include "simd.h"
+#include "sampler.h"
+
+/* How much of a Frozen network runs in int8 */
+enum Quantize {
+  QUANT_NONE = 0,
+  QUANT_WEIGHTS, //int8 weights, each row with its own scale, times full precision activations
+  QUANT_ALL //the activations rounded to int8 for each product as well, where the CPU has VNNI
+};
+
+/* An int8 matrix, row r standing for its values times scale[r] */
+struct QMatrix {
+  size_t rows;
+  size_t cols;
+  size_t stride; //bytes between the starts of rows
+  std::vector<int8_t> q;
+  std::vector<float> scale;
+
+  const int8_t* row(size_t r) const { return q.data() + r * stride; }
+
+  QMatrix(): rows(0), cols(0), stride(0) { }
+
+  /* Round rows x cols values, element (r, c) at src[r * rs + c * cs], each row scaled by its largest magnitude */
+  QMatrix(const real*, size_t, size_t, size_t, size_t);
+};
+
+/* True when a file holds a network written by Frozen::write */
+bool quantized_file(const std::string&);
+
+/*
+A trained network rearranged for generating one stream, with nothing kept for backprop
+The first layer's input weights are transposed, so a character's column is one contiguous
+row, and each later layer's input and recurrent weights sit side by side, so a step reads
+each layer's weights once in a single product
+The h of every layer shares one buffer, layer l reading layers l - 1 and l as one vector
+Every buffer is sized up front, so feeding and generating never allocate
+Quantized, the embedding, gate and output weights are kept in int8 only, a quarter or an
+eighth of the bytes to read each step; the biases and the cell state stay full precision
+*/
+class Frozen {
+public:
+  Sampler sampler; //draws the characters sample() and generate() give, seeded at random
+
+  /* Clear the state of every layer; the next prediction is uniform */
+  void reset();
+
+  /* Feed one character, leaving the distribution over the next in probs(); one without an index feeds a zero input, still advancing the state */
+  void feed(char);
+
+  const real* probs() const { return o.data(); }
+
+  /* Draw a character from probs() with the sampler */
+  char sample();
+
+  /* From a clear state feed a prompt, then write n characters to out, each fed back in */
+  void generate(const char*, size_t, char*, size_t);
+
+  void seed(uint64_t s) { sampler.seed(s); }
+
+  /* Bytes of weights held, biases included */
+  size_t weight_bytes() const;
+
+  /* Write the int8 weights to a file, which only a Frozen can load; the network must be quantized */
+  void write(const std::string&) const;
+
+  /* Copy a trained network, using the kernels of the current accuracy tier */
+  explicit Frozen(const Net&, Quantize = QUANT_NONE);
+
+  /*
+  Load a network written by write_net, or one written by write, which stays quantized
+  however it is asked to load
+  */
+  explicit Frozen(const std::string&, Quantize = QUANT_NONE);
+
+private:
+  size_t layers;
+  size_t m; //input size
+  size_t n; //hidden cells
+  size_t s; //output size
+  const Kernels<real>* k; //the generic ones, a single stream measuring no faster with the fixed size kernels
+
+  Matrix<real> embed; //m x 4n, transposed input weights of the first layer
+  std::vector<Matrix<real> > weights; //4n x n recurrent weights for the first layer, 4n x 2n [w u] for the rest
+  std::vector<std::vector<real> > bias;
+  Matrix<real> out_w; //n x s
+  std::vector<real> out_b;
+
+  std::vector<real> h; //layers x n
+  std::vector<real> state; //layers x n
+  std::vector<real> pre; //4n
+  std::vector<real> act; //4n
+  std::vector<real> o; //s
+
+  Quantize quant;
+  QMatrix qembed; //m x 4n
+  std::vector<QMatrix> qweights; //as weights
+  QMatrix qout; //s x n, transposed output weights
+  std::vector<real> logits; //s
+  void (*qgemv)(const int8_t*, size_t, size_t, size_t, const float*, const real*, real*, bool);
+
+  void freeze(const Net&, Quantize);
+  void read(const std::string&, Quantize);
+
+  /* Pick the kernels and size the buffers once the weights are in */
+  void prepare();
+};
+
+#endif /* frozen.h */
@@ -0,0 +1,79 @@
+/*******************************************************************************
+ * Name        : prefix.h
+ * Author      : Ben Blease
+ * Date        : 11/8/17
+ * Description : Cache of the recurrent state after common prompt prefixes
+ ******************************************************************************/
+
+#ifndef PREFIX_H_
+#define PREFIX_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include "core.h"
+
+struct PrefixStats {
+  size_t lookups;
+  size_t hits; //lookups that found a prefix
+  size_t skipped; //prompt characters hits saved feeding
+  size_t stored;
+  size_t evicted;
+  size_t entries; //snapshots held
+  size_t bytes; //held, snapshots and trie together
+
+  PrefixStats(): lookups(0), hits(0), skipped(0), stored(0), evicted(0), entries(0), bytes(0) { }
+};
+
+/*
+Trie of prompt prefixes, holding at some nodes the h and state of every layer once that
+prefix has been fed from a clear state
+Edges are runs of characters, so there are only nodes where prefixes branch or end
+Snapshots are evicted least recently used first to keep under a memory cap, along with
+any branch of the trie left holding none
+Not thread safe; each engine keeps its own
+*/
+class PrefixCache {
+public:
+  PrefixStats stats;
+
+  /*
+  Restore the longest held prefix shorter than a prompt into one row of a context,
+  returning its length, or clear the row and return 0 when there is none
+  shared gets how much of the prompt, short of its last character, an earlier prompt began
+  with, where a snapshot would serve both
+  */
+  size_t restore(const std::string&, Context&, int, size_t&);
+
+  /* Hold the state of one row of a context after the first so many characters of a prompt */
+  void store(const std::string&, size_t, const Context&, int);
+
+  /* l - layers, n - hidden cells, cap - bytes to hold at most */
+  PrefixCache(size_t, size_t, size_t);
+
+  ~PrefixCache();
+
+private:
+  struct Node {
+    Node* parent;
+    std::string edge; //characters from the parent, keying it there by the first
+    std::map<char, Node*> children;
+    std::vector<real> snap; //h then state of every layer, empty when none is held
+    std::list<Node*>::iterator age; //in lru while a snapshot is held
+  };
+
+  size_t layers;
+  size_t n;
+  size_t cap;
+  Node root;
+  std::list<Node*> lru; //most recently used first
+
+  void evict();
+  void remove(Node*);
+
+  PrefixCache(const PrefixCache&);
+  PrefixCache& operator=(const PrefixCache&);
+};
+
+#endif /* prefix.h */
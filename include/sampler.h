@@ -0,0 +1,64 @@
+/*******************************************************************************
+ * Name        : sampler.h
+ * Author      : Ben Blease
+ * Date        : 11/12/17
+ * Description : Drawing characters from predicted distributions
+ ******************************************************************************/
+
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+#include "serialized.h"
+
+/* How a Sampler narrows and reshapes a distribution before drawing from it */
+struct SampleParams {
+  double temperature; //weights become p^(1/temperature); 1 leaves them, 0 is greedy
+  size_t top_k; //draw among the k most likely only, 0 for all
+  double top_p; //draw among the fewest most likely holding this much of the weight, 1 for all
+
+  SampleParams(): temperature(1.0), top_k(0), top_p(1.0) { }
+};
+
+/*
+Draws indices from distributions with its own seeded xoshiro256** generator, so a stream
+of draws is reproducible and independent of any other sampler
+A plain draw is one cumulative search over the probabilities; temperature, top-k and top-p
+work in scratch kept between draws, top-k by partial selection and top-p by sorting only
+the candidates left, so nothing is allocated once the scratch has reached the output size
+Weights need not be normalised
+*/
+class Sampler {
+public:
+  SampleParams params;
+
+  /* Index drawn from s weights */
+  size_t draw(const real*, size_t);
+
+  /* Character drawn from a distribution over the printable characters */
+  char pick(const real* p, size_t s) { return (char) (draw(p, s) + 32); }
+
+  /* Index of the largest of s weights, the first on a tie */
+  static size_t greedy(const real*, size_t);
+
+  void seed(uint64_t);
+
+  /* Size the scratch for distributions of s entries */
+  void reserve(size_t);
+
+  explicit Sampler(uint64_t = 0, const SampleParams& = SampleParams());
+
+private:
+  uint64_t rng[4];
+  std::vector<real> w; //reshaped weights
+  std::vector<int> idx; //candidates left after top-k and top-p
+
+  uint64_t next();
+
+  /* In [0, 1) */
+  double uniform();
+};
+
+#endif /* sampler.h */
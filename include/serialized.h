@@ -9,28 +9,139 @@ Serialized vector and matrix arithmetic for use with CPUs
 #include <vector>
 #include <iostream>
 #include <utility>
+#include <new>
+#include <stdlib.h>
+#include "simd.h"
+
+/*
+Numeric type of the network, picked at build time with make PRECISION=<mode>
+  double - double storage and arithmetic (default)
+  single - float storage and arithmetic; half the bandwidth, twice the SIMD lanes
+  mixed  - float storage, with gradient sums accumulated in double
+*/
+#if defined(RNN_SINGLE) || defined(RNN_MIXED)
+typedef float real;
+#else
+typedef double real;
+#endif
+
+#ifdef RNN_MIXED
+typedef double accum;
+#else
+typedef real accum;
+#endif
 
 //vect.cpp
-void print_vector(const std::vector<double>&);
+void print_vector(const std::vector<real>&);
 
-double operator*(const std::vector<double>&, const std::vector<double>&);
+real operator*(const std::vector<real>&, const std::vector<real>&);
 
-double v_sum(const std::vector<double>&);
+real v_sum(const std::vector<real>&);
 
-std::vector<double> operator*(const std::vector<double>&, double);
+std::vector<real> operator*(const std::vector<real>&, double);
 
-std::vector<double> operator/(const std::vector<double>&, double);
+std::vector<real> operator/(const std::vector<real>&, double);
 
 //override the addition operator
-std::vector<double> operator+(const std::vector<double>&, const std::vector<double>&);
+std::vector<real> operator+(const std::vector<real>&, const std::vector<real>&);
+
+std::vector<real> operator-(const std::vector<real>&, const std::vector<real>&);
+
+std::vector<real> h_prod(const std::vector<real>&, const std::vector<real>&);
+
+std::vector<real> activate(const std::vector<real>&, double(*)(const double&));
+
+/* 
+In-place and output parameter forms
+None of these allocate once the destination is sized
+*/
+std::vector<real>& operator+=(std::vector<real>&, const std::vector<real>&);
+
+std::vector<real>& operator-=(std::vector<real>&, const std::vector<real>&);
+
+std::vector<real>& operator*=(std::vector<real>&, double);
+
+std::vector<real>& operator/=(std::vector<real>&, double);
+
+/* y += a * x */
+void axpy(double, const std::vector<real>&, std::vector<real>&);
+
+/* out = a o b */
+void h_prod(const std::vector<real>&, const std::vector<real>&, std::vector<real>&);
+
+/* out += a o b */
+void h_prod_add(const std::vector<real>&, const std::vector<real>&, std::vector<real>&);
+
+/* out = f(x), out may be x */
+void activate(const std::vector<real>&, std::vector<real>&, double(*)(const double&));
+
+/* Vectorized forms of the common activations, no call per element */
+std::vector<real> activate(const std::vector<real>&, Activation);
+
+void activate(const std::vector<real>&, std::vector<real>&, Activation);
+
+/*
+Allocator handing out 64 byte aligned blocks
+Keeps every matrix buffer on a cache line boundary (and wide enough for AVX-512 loads)
+*/
+#define MATRIX_ALIGN 64
+
+template <class T>
+struct AlignedAllocator {
+	typedef T value_type;
+
+	T* allocate(size_t n){
+		void* p = NULL;
+		if (posix_memalign(&p, MATRIX_ALIGN, n * sizeof(T)) != 0)
+			throw std::bad_alloc();
+		return (T*) p;
+	}
+
+	void deallocate(T* p, size_t){
+		free(p);
+	}
+
+	AlignedAllocator() { }
+
+	template <class U>
+	AlignedAllocator(const AlignedAllocator<U>&) { }
+};
+
+template <class T, class U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return true; }
+
+template <class T, class U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return false; }
+
+/*
+Non-owning window onto a matrix (or a block of one)
+Rows are stride elements apart, so a block shares the parent's storage
+*/
+template <class T>
+struct MatrixView {
+	T* data;
+	int x; //columns
+	int y; //rows
+	int stride;
 
-std::vector<double> operator-(const std::vector<double>&, const std::vector<double>&);
+	inline T* operator[](int i) const {
+		return data + (size_t) i * stride;
+	}
 
-std::vector<double> h_prod(const std::vector<double>&, const std::vector<double>&);
+	/* Sub-block starting at column c, row r */
+	inline MatrixView<T> block(int c, int r, int cols, int rows) const {
+		return MatrixView<T>(data + (size_t) r * stride + c, cols, rows, stride);
+	}
 
-std::vector<double> activate(const std::vector<double>&, double(*)(const double&));
+	MatrixView(T* d, int cols, int rows, int s): data(d), x(cols), y(rows), stride(s) { }
+};
 
-/* A 2d Matrix */
+/*
+A 2d Matrix
+Stored as a single row-major buffer, each row padded out to a multiple of MATRIX_ALIGN bytes
+Padding is always kept at 0 so kernels may safely run over whole strides
+The buffer is either owned or borrowed (e.g. from a mapped file); copies always own theirs
+*/
 template <class T>
 class Matrix {
 public:
@@ -55,6 +166,45 @@ public:
 
 	std::vector<T> mult_x(const std::vector<T>&);
 
+	/* out = M * x, or out += M * x when accumulating */
+	void gemv(const std::vector<T>&, std::vector<T>&, bool = false);
+
+	/* out = transpose(M) * x, or out += transpose(M) * x when accumulating */
+	void gemv_t(const std::vector<T>&, std::vector<T>&, bool = false);
+
+	Matrix<T>& operator+=(const Matrix<T>&);
+
+	Matrix<T>& operator-=(const Matrix<T>&);
+
+	Matrix<T>& operator*=(double);
+
+	/* M += a * B */
+	void axpy(double, const Matrix<T>&);
+
+	/* M += a * (x outer y), without building the outer product */
+	void add_outer(double, const std::vector<T>&, const std::vector<T>&);
+
+	/* Raw forms of the above; x and out must hold rows/cols elements as required */
+	void gemv(const T*, T*, bool = false);
+
+	void gemv_t(const T*, T*, bool = false);
+
+	void add_outer(double, const T*, const T*);
+
+	/*
+	Batched forms over streams vectors: x_b starts at x + b * ldx, out_b at out + b * ldo
+	gemm gives out_b = M * x_b, gemm_t gives out_b = transpose(M) * x_b
+	*/
+	void gemm(const T*, size_t, T*, size_t, size_t, bool = false);
+
+	void gemm_t(const T*, size_t, T*, size_t, size_t, bool = false);
+
+	/* M += a * sum over streams of (x_b outer y_b), x_b and y_b spaced ldx and ldy apart */
+	void add_outer(double, const T*, size_t, const T*, size_t, size_t);
+
+	/* Set every element (padding stays 0) */
+	void fill(T);
+
 	/* Return the x/y size of the matrix */
 	std::pair<int, int> size();
 
@@ -63,6 +213,38 @@ public:
 
 	void print_matrix();
 
+	/* Row access, m[i][j] */
+	inline T* operator[](int i) { return _p + (size_t) i * _stride; }
+	inline const T* operator[](int i) const { return _p + (size_t) i * _stride; }
+
+	inline T* data() { return _p; }
+	inline const T* data() const { return _p; }
+
+	/* The buffer belongs to someone else */
+	inline bool borrowed() const { return _p && _v.empty(); }
+
+	/* Copy a borrowed buffer into one of its own, so it can be written */
+	void own();
+
+	/* Use storage laid out as this matrix already is (padded stride), dropping its own buffer */
+	void borrow(T*);
+
+	inline int cols() const { return _x; }
+	inline int rows() const { return _y; }
+	inline int stride() const { return _stride; }
+
+	/* View of the whole matrix */
+	MatrixView<T> view();
+
+	/* View of a single row (1 x cols) */
+	MatrixView<T> row(int);
+
+	/* View of the block starting at column c, row r */
+	MatrixView<T> block(int, int, int, int);
+
+	/* Row stride used for a number of columns */
+	static int padded(int);
+
 	/* Generate a matrix from an already existing 2d vector */
 	Matrix(const std::vector<std::vector<T> >&);
 
@@ -71,14 +253,22 @@ public:
 
 	Matrix(int, int, T);
 
+	Matrix(const Matrix<T>&);
+
+	Matrix<T>& operator=(const Matrix<T>&);
+
 	Matrix();
 
 private:
 	int _x; //columns
 	int _y; //rows
-	std::vector<std::vector<T> > _v;
+	int _stride; //elements between the start of consecutive rows
+	std::vector<T, AlignedAllocator<T> > _v; //empty when borrowing
+	T* _p; //start of the buffer, owned or not
+
+	inline size_t elements() const { return (size_t) _y * _stride; }
 };
 
 
 
-#endif /* serialized.h */
\ No newline at end of file
+#endif /* serialized.h */
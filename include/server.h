@@ -0,0 +1,106 @@
+/*******************************************************************************
+ * Name        : server.h
+ * Author      : Ben Blease
+ * Date        : 11/6/17
+ * Description : Batched inference over many sessions at once
+ ******************************************************************************/
+
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include "core.h"
+#include "prefix.h"
+#include "sampler.h"
+
+/* A generation request and how far it has got */
+struct Session {
+  long id;
+  std::string prompt;
+  size_t length; //characters to generate
+  std::string out;
+  size_t fed; //characters fed so far, prompt then output
+  size_t shared; //prompt characters an earlier prompt began with, snapshotted there for later ones
+  Sampler sampler; //its own, seeded with the id, so what it generates does not depend on what it was batched with
+  std::chrono::steady_clock::time_point arrived;
+  double first; //seconds from arrival to the first character
+  double latency; //seconds from arrival to the last character
+};
+
+struct EngineStats {
+  size_t requests; //finished
+  size_t generated; //characters
+  size_t steps;
+  size_t occupancy; //sessions summed over steps
+  double busy; //seconds spent stepping
+
+  EngineStats(): requests(0), generated(0), steps(0), occupancy(0), busy(0) { }
+};
+
+/*
+Advances many sessions together, each with its own hidden and cell state in one row of a
+shared Context, so every step is one batched product per weight matrix
+Waiting sessions are admitted into free rows and finished ones retired between steps, so
+new requests join the batch without waiting for it to drain
+With a prefix cache, sessions start from the state after the longest prompt prefix held,
+then store snapshots where their prompt branches from earlier ones and just before its end
+*/
+class Engine {
+public:
+  EngineStats stats;
+
+  /* Queue a prompt and the number of characters to generate from it, returning its id */
+  long submit(const std::string&, size_t, const SampleParams& = SampleParams());
+
+  /* One character for every active session, admitting waiting ones first; finished sessions are added to the list */
+  void step(std::vector<Session>&);
+
+  size_t active() const { return slots.size(); }
+
+  size_t waiting() const { return queue.size(); }
+
+  /* NULL without one */
+  const PrefixCache* prefixes() const { return cache; }
+
+  /*
+  The network is only read, so engines on different threads can share it
+  net - network to run
+  c - sessions advanced together
+  cache - bytes of prefix snapshots to hold, 0 for none
+  */
+  Engine(Net*, int, size_t = 0);
+
+  ~Engine();
+
+private:
+  Net* net;
+  Context ctx; //row k holds slots[k]
+  int capacity;
+  std::vector<Session> slots;
+  std::deque<Session> queue;
+  std::vector<int> index;
+  long next_id;
+  PrefixCache* cache;
+
+  void admit();
+  void retire(int);
+
+  Engine(const Engine&);
+  Engine& operator=(const Engine&);
+};
+
+/*
+Serve requests read a line at a time until the input ends, replying as each one finishes
+  request "<length> <prompt>" - reply "<id> <latency in us> <output>", ids counting from 0 in request order
+  request "stats" - reply "stats <requests> <characters> <characters/s> <mean batch> <prefix hit rate>"
+Malformed requests get "error <reason>"; a stats line follows the last reply
+Arguments are the network, the sessions advanced together and the bytes of prefix cache
+*/
+void serve(Net*, int, size_t, std::istream&, std::ostream&);
+
+#endif /* server.h */
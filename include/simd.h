@@ -0,0 +1,168 @@
+/*******************************************************************************
+ * Name        : simd.h
+ * Author      : Ben Blease
+ * Date        : 10/26/17
+ * Description : Vector kernels with runtime instruction set dispatch
+ ******************************************************************************/
+
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <cstddef>
+#include <stdint.h>
+
+/* Instruction sets with a kernel implementation, ordered worst to best */
+enum Isa {
+  ISA_SCALAR = 0,
+  ISA_SSE2,
+  ISA_AVX2,
+  ISA_AVX512,
+  ISA_COUNT
+};
+
+/* Elementwise functions the kernels can apply without a call per element */
+enum Activation {
+  SIGMOID = 0,
+  TANH,
+  DERIV_SIGMOID,
+  DERIV_TANH,
+  DERIV_SIGMOID_OUT, //derivatives given the activation y rather than x
+  DERIV_TANH_OUT,
+  ACTIVATION_COUNT
+};
+
+/*
+Accuracy tiers for the activations, ordered slowest to fastest
+The tiers shorten the exponential's polynomial, to roughly 1e-6 and 1e-3 absolute error
+*/
+enum Accuracy {
+  ACC_EXACT = 0,
+  ACC_1E6,
+  ACC_1E3,
+  ACC_COUNT
+};
+
+/* Network shapes with fixed size kernels, see FixedKernels */
+#define FIXED_SHAPES 3
+
+/*
+Gate kernels for a batch of streams through blocks of n hidden cells, with every dimension
+but the batch a compile time constant so the loops have fixed trip counts and no tails
+Argument lists are those of the generic kernels less the dimensions; a single stream
+measures no faster with them, so it keeps the generic kernels
+*/
+template <class T>
+struct FixedKernels {
+  size_t n;
+
+  /*
+  out = M * x over a batch, for M 4n x n with a row stride, u or a later layer's w
+  arguments are M, stride, x, ldx, out, ldo, batch, acc
+  */
+  void (*gemm_u)(const T*, size_t, const T*, size_t, T*, size_t, size_t, bool);
+
+  /* lstm_cell for n cells */
+  void (*lstm_cell)(T*, const T*, const T*, T*, T*, T*);
+};
+
+/*
+Table of kernels for one instruction set
+All lengths are element counts; pointers need no particular alignment
+*/
+template <class T>
+struct Kernels {
+  const char* name;
+
+  /* sum of a o b */
+  T (*dot)(const T*, const T*, size_t);
+
+  /* out = a o b */
+  void (*h_prod)(const T*, const T*, T*, size_t);
+
+  /* out += a o b */
+  void (*h_prod_add)(const T*, const T*, T*, size_t);
+
+  /* y += a * x */
+  void (*axpy)(T, const T*, T*, size_t);
+
+  /* out = M * x (out += M * x when accumulating), M is rows x cols with a row stride */
+  void (*gemv)(const T*, size_t, size_t, size_t, const T*, T*, bool);
+
+  /*
+  gemv over a batch: out_b = M * x_b for batch vectors x_b spaced ldx apart,
+  results spaced ldo apart; arguments are M, rows, cols, stride, x, ldx, out, ldo, batch, acc
+  */
+  void (*gemm)(const T*, size_t, size_t, size_t, const T*, size_t, T*, size_t, size_t, bool);
+
+  /*
+  out_r += a * sum over p < k of c[r * rs + p * ps] * src_p for rows out_r of len elements
+  arguments are out, rows, len, ldo, a, c, rs, ps, src, lds, k
+  Covers transpose(M) * x over a batch and sums of outer products
+  */
+  void (*row_update)(T*, size_t, size_t, size_t, T, const T*, size_t, size_t, const T*, size_t, size_t);
+
+  /*
+  Softmax output layer for one stream, W being n x s with a row stride
+    o = softmax(transpose(W) x + b), shifted by the largest logit for stability
+    dx = W (o - e_y), the delta for the last block, when dx is not NULL
+  Returns the normaliser and leaves the target's shifted logit in ly, so the
+  cross-entropy is log(normaliser) - ly; arguments are W, n, s, stride, b, x, o, y, dx, ly
+  */
+  T (*output)(const T*, size_t, size_t, size_t, const T*, const T*, T*, int, T*, T*);
+
+  /* out = f(x), out may alias x */
+  void (*activate[ACTIVATION_COUNT])(const T*, T*, size_t);
+
+  /*
+  Fused LSTM cell update for n cells
+  pre holds the stacked z, i, f, o pre-activations (4n) and gets the bias b added in place
+  act receives the stacked activations, then
+    c = f o c_prev + i o z
+    h = o o sigmoid(c)
+  */
+  void (*lstm_cell)(T*, const T*, const T*, T*, T*, T*, size_t);
+
+  /*
+  out = D(Q) * x (out += D(Q) * x when accumulating) for int8 weights Q, rows x cols with a row
+  stride in bytes, row r of D(Q) being row r of Q times scale[r]
+  arguments are Q, rows, cols, stride, scale, x, out, acc
+  */
+  void (*gemv_q8)(const int8_t*, size_t, size_t, size_t, const float*, const T*, T*, bool);
+
+  /*
+  gemv_q8 with x rounded to int8 as well, by its largest magnitude, so the products are
+  integer dot products; NULL unless the CPU has AVX-512 VNNI
+  */
+  void (*gemv_q8x8)(const int8_t*, size_t, size_t, size_t, const float*, const T*, T*, bool);
+
+  /* FIXED_SHAPES tables for the shapes built, the same shapes in the same order for every table */
+  const FixedKernels<T>* fixed;
+};
+
+/* Best kernels the running CPU supports, picked once by CPUID, at the current accuracy */
+template <class T>
+const Kernels<T>& kernels();
+
+/* Kernels for a specific instruction set and accuracy, NULL when the CPU lacks it */
+template <class T>
+const Kernels<T>* kernels(Isa, Accuracy = ACC_EXACT);
+
+/* Index into Kernels::fixed of the shape with n hidden cells, -1 when none is built */
+template <class T>
+int fixed_shape(size_t);
+
+bool isa_supported(Isa);
+
+const char* isa_name(Isa);
+
+/*
+Accuracy tier used by kernels(), RNN_ACCURACY=<name> in the environment sets the initial one
+Changing it affects later calls to kernels() only
+*/
+void set_accuracy(Accuracy);
+
+Accuracy accuracy();
+
+const char* accuracy_name(Accuracy);
+
+#endif /* simd.h */
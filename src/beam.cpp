@@ -0,0 +1,107 @@
+/*******************************************************************************
+ * Name        : beam.cpp
+ * Author      : Ben Blease
+ * Date        : 11/13/17
+ * Description : Beam search decoding over a batch of forked states
+ ******************************************************************************/
+
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include "beam.h"
+
+using namespace std;
+
+typedef pair<double, int> Candidate; //score, then parent row * s + character index
+
+/*
+Only the parent row and character of each step are kept while searching, the texts are
+read back from them at the end
+*/
+vector<Beam> beam_search(Net* net, const string& prompt, size_t length, int width){
+  if (width < 1)
+    throw runtime_error("A beam search needs a width of at least one");
+  if (prompt.empty())
+    throw runtime_error("Empty prompt");
+  size_t layers = net->layer_num;
+  size_t s = net->inp_size;
+  size_t n = net->node_num;
+  Context ctx(layers, s, n, width);
+
+  //the prompt through the first row alone
+  ctx.streams = 1;
+  for (char c : prompt){
+    int index = char_index(c);
+    net->input->forward(ctx, NULL, &index, NULL);
+  }
+
+  vector<double> score(1, 0.0);
+  vector<int> parent(length * width), chars(length * width);
+  vector<Candidate> cand;
+  cand.reserve(width);
+  vector<int> index(width);
+  vector<vector<real> > h(layers, vector<real>(width * n)), state(layers, vector<real>(width * n));
+  int live = 1;
+  for (size_t t = 0; t < length; t++){
+    //the best width candidates in a heap, worst on top; a character whose probability cannot
+    //lift its beam's score past the worst kept is skipped before taking its log
+    cand.clear();
+    for (int b = 0; b < live; b++){
+      const real* o = ctx.o.data() + b * s;
+      double floor = ((int) cand.size() == width) ? exp(cand.front().first - score[b]) : 0.0;
+      for (size_t c = 0; c < s; c++){
+        if (o[c] <= floor)
+          continue;
+        Candidate next(score[b] + log(o[c]), b * s + c);
+        if ((int) cand.size() < width){
+          cand.push_back(next);
+          push_heap(cand.begin(), cand.end(), greater<Candidate>());
+        } else if (next > cand.front()){
+          pop_heap(cand.begin(), cand.end(), greater<Candidate>());
+          cand.back() = next;
+          push_heap(cand.begin(), cand.end(), greater<Candidate>());
+          floor = exp(cand.front().first - score[b]);
+        }
+      }
+    }
+    int keep = cand.size();
+    sort_heap(cand.begin(), cand.end(), greater<Candidate>());
+
+    //fork the kept rows from their parents
+    score.resize(keep);
+    for (int j = 0; j < keep; j++){
+      int from = cand[j].second / s;
+      score[j] = cand[j].first;
+      parent[t * width + j] = from;
+      chars[t * width + j] = index[j] = cand[j].second % s;
+      for (size_t l = 0; l < layers; l++){
+        copy(ctx.h[l].begin() + from * n, ctx.h[l].begin() + (from + 1) * n, h[l].begin() + j * n);
+        copy(ctx.state[l].begin() + from * n, ctx.state[l].begin() + (from + 1) * n, state[l].begin() + j * n);
+      }
+    }
+    for (size_t l = 0; l < layers; l++){
+      ctx.h[l].swap(h[l]);
+      ctx.state[l].swap(state[l]);
+    }
+    live = keep;
+
+    //the last characters need no prediction after them
+    if (t + 1 < length){
+      ctx.streams = live;
+      net->input->forward(ctx, NULL, index.data(), NULL);
+    }
+  }
+
+  vector<Beam> beams(live);
+  for (int j = 0; j < live; j++){
+    beams[j].score = score[j];
+    beams[j].text.resize(length);
+    int row = j;
+    for (size_t t = length; t-- > 0; ){
+      beams[j].text[t] = (char) (chars[t * width + row] + 32);
+      row = parent[t * width + row];
+    }
+  }
+  return beams;
+}
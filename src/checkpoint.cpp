@@ -0,0 +1,150 @@
+/*******************************************************************************
+ * Name        : checkpoint.cpp
+ * Author      : Ben Blease
+ * Date        : 11/2/17
+ * Description : Background saves of a network while it trains
+ ******************************************************************************/
+
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "checkpoint.h"
+
+using namespace std;
+
+/*
+p - path of the save file
+e - steps between saves, 0 for none
+t - seconds between saves, 0 for none
+*/
+Checkpointer::Checkpointer(const string& p, size_t e, double t): 
+                           path(p), 
+                           every(e), 
+                           seconds(t), 
+                           last_step(0), 
+                           last_time(Clock::now()), 
+                           source(NULL), 
+                           copying(false), 
+                           pending(false), 
+                           owed(false), 
+                           stall(0), 
+                           stop(false) {
+  writer = thread(&Checkpointer::run, this);
+}
+
+Checkpointer::~Checkpointer(){
+  {
+    lock_guard<mutex> lock(m);
+    stop = true;
+  }
+  cv.notify_all();
+  writer.join();
+}
+
+void Checkpointer::tick(Net* net, size_t step){
+  bool due = every && step - last_step >= every;
+  if (!due && seconds > 0)
+    due = chrono::duration<double>(Clock::now() - last_time).count() >= seconds;
+  if (!due)
+    return;
+  last_step = step;
+  last_time = Clock::now();
+  take(net);
+}
+
+/* 
+Only the training thread that takes saves calls this, settle and flush
+The stall of a save is the time spent here and waiting in settle for its copy
+*/
+bool Checkpointer::take(Net* net){
+  Clock::time_point start = Clock::now();
+  {
+    lock_guard<mutex> lock(m);
+    if (pending){
+      stats.skipped++;
+      return false;
+    }
+  }
+  //the last save is written, so copied; close its stall
+  settle();
+  {
+    lock_guard<mutex> lock(m);
+    pending = true;
+    source = net;
+  }
+  cv.notify_all();
+  owed = true;
+  stall = chrono::duration<double>(Clock::now() - start).count();
+  stats.saves++;
+  return true;
+}
+
+void Checkpointer::settle(){
+  if (!owed)
+    return;
+  Clock::time_point start = Clock::now();
+  {
+    unique_lock<mutex> lock(m);
+    claim(lock);
+    cv.wait(lock, [&]{ return !copying; });
+  }
+  owed = false;
+  stall += chrono::duration<double>(Clock::now() - start).count();
+  stats.stall_total += stall;
+  stats.stall_max = max(stats.stall_max, stall);
+}
+
+void Checkpointer::flush(){
+  settle();
+  unique_lock<mutex> lock(m);
+  cv.wait(lock, [&]{ return !pending; });
+}
+
+/* Copy the network taken into the image, unless another thread already has; called holding m */
+void Checkpointer::claim(unique_lock<mutex>& lock){
+  if (!source)
+    return;
+  Net* net = source;
+  source = NULL;
+  copying = true;
+  lock.unlock();
+  net_image(net, image);
+  lock.lock();
+  copying = false;
+  cv.notify_all();
+}
+
+/* Write each image handed over, finishing any pending one before stopping */
+void Checkpointer::run(){
+  //below the trainers and never preempting them on wakeup, for when they share a core
+  pid_t tid = syscall(SYS_gettid);
+  sched_param sp = {0};
+  sched_setscheduler(tid, SCHED_BATCH, &sp);
+  setpriority(PRIO_PROCESS, tid, WRITER_NICE);
+  unique_lock<mutex> lock(m);
+  while (true){
+    cv.wait(lock, [&]{ return pending || stop; });
+    if (!pending)
+      return;
+    Clock::time_point start = Clock::now();
+    claim(lock);
+    cv.wait(lock, [&]{ return !copying; });
+    lock.unlock();
+    bool ok = true;
+    try {
+      write_image(image, path, true);
+    } catch (runtime_error& e){
+      cerr << e.what() << endl;
+      ok = false;
+    }
+    double elapsed = chrono::duration<double>(Clock::now() - start).count();
+    lock.lock();
+    stats.write_total += elapsed;
+    stats.failed += ok ? 0 : 1;
+    pending = false;
+    cv.notify_all();
+  }
+}
@@ -11,7 +11,13 @@
 #include <unistd.h>
 #include <string>
 #include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "core.h"
+#include "checkpoint.h"
+#include "corpus.h"
+#include "frozen.h"
 
 using namespace std;
 
@@ -36,96 +42,308 @@ double ReLu(const double& x){
   return max(x, 0.0);
 }
 
-//2D vectors passed to constructors are not matricies. 
-//Instead, they provide z i f o information for indeces 0 - 3 
-TimeStep::TimeStep(vector<vector<double> > g, 
-                   vector<vector<double> > i,
-                   vector<double> x,
-                   vector<double> o, 
-                   vector<double> st, 
-                   int n): 
-                   gates(g),
-                   input(x), 
-                   inputs(i), 
-                   output(o), 
-                   state(st) { 
-  dels = vector<vector<double> >(5, vector<double>(n, 0.0));
-}
-
-void TimeStep::set_delts(vector<double> z, 
-           vector<double> i, 
-           vector<double> f, 
-           vector<double> o, 
-           vector<double> c){
-  dels[Z] = z;
-  dels[I] = i;
-  dels[F] = f;
-  dels[O] = o;
-  dels[C] = c;
-}
-
-void TimeRange::push(int l, TimeStep t){
-  if (q[l].size() == max_size){
-    q[l].pop_front();
+Context::Context(size_t l, size_t s, size_t n, int k): 
+                 streams(k),
+                 h(vector<vector<real> >(l, vector<real>(k * n, 0.0))),
+                 state(vector<vector<real> >(l, vector<real>(k * n, 0.0))),
+                 pre(vector<vector<real> >(l, vector<real>(4 * k * n, 0.0))),
+                 act(vector<vector<real> >(l, vector<real>(4 * k * n, 0.0))),
+                 o(vector<real>(k * s, 0.0)),
+                 loss(0.0),
+                 scored(0) { }
+
+void Context::reset(){
+  for (size_t l = 0; l < h.size(); l++){
+    h[l].assign(h[l].size(), 0.0);
+    state[l].assign(state[l].size(), 0.0);
   }
-  q[l].push_back(t);
 }
 
-/* Take the outer product of vectors */
-Matrix<double> outer(const vector<double>& a, const vector<double>& b){
-  vector<vector<double> > out;
-  for (size_t i = 0; i < a.size(); i++)
-    out.push_back(b * a[i]);
-  return Matrix<double>(out);
+double Context::take_loss(){
+  double mean = scored ? loss / scored : 0.0;
+  loss = 0.0;
+  scored = 0;
+  return mean;
 }
 
 /*
-Calculate the delta resulting from the output (dE/dyt)
-Returns an n x s vector
+s - the number of timesteps held
+m - input size per stream
+n - the number of hidden cells
+k - the number of streams
+Gate vectors are stacked z i f o, n entries per gate and stream
 */
-Matrix<double> Output::calc_delta(vector<double> y){
-  vector<double> out_err = o - y;
-  return outer(x, out_err);
+Slab::Slab(int s, size_t m, size_t n, int k): 
+           gates(vector<real>(s * k * 4 * n)),
+           inputs(vector<real>(s * k * 4 * n)),
+           input(vector<real>(s * k * m)),
+           output(vector<real>(s * k * n)),
+           state(vector<real>(s * k * n)),
+           index(vector<int>(s * k)),
+           dels(vector<real>(s * k * 5 * n)),
+           del_x(vector<real>(s * k * n)),
+           step(vector<TimeStep>(s)) {
+  for (int t = 0; t < s; t++){
+    TimeStep& v = step[t];
+    v.gates = &gates[t * k * 4 * n];
+    v.inputs = &inputs[t * k * 4 * n];
+    v.input = &input[t * k * m];
+    v.output = &output[t * k * n];
+    v.state = &state[t * k * n];
+    v.index = &index[t * k];
+    v.sparse = false;
+    v.dels = &dels[t * k * 5 * n];
+    v.del_x = &del_x[t * k * n];
+  }
 }
 
-/* 
-Produce output from the network
+TimeStep* TimeRange::push(int l){
+  if (count[l] == max_size)
+    head[l] = (head[l] + 1) % max_size;
+  else
+    count[l]++;
+  TimeStep* t = back(l);
+  size_t n = ctx.h[l].size();
+  fill(t->dels, t->dels + 5 * n, 0.0);
+  fill(t->del_x, t->del_x + n, 0.0);
+  return t;
+}
+
+/*
+Log a step of a checkpointed window
+The context still holds the state from before the step, which is what a checkpoint keeps
+A window may hold one step more than its size, as the first one of training does
+*/
+void TimeRange::record(const int* index, const int* y){
+  if (!interval)
+    return;
+  if (fed > window)
+    throw runtime_error("BPTT window overrun");
+  copy(index, index + streams, log_index.begin() + fed * streams);
+  copy(y, y + streams, log_target.begin() + fed * streams);
+  if (fed % interval == 0){
+    for (size_t l = 0; l < ckpt_h.size(); l++){
+      size_t width = ctx.h[l].size();
+      copy(ctx.h[l].begin(), ctx.h[l].end(), ckpt_h[l].begin() + fed / interval * width);
+      copy(ctx.state[l].begin(), ctx.state[l].end(), ckpt_state[l].begin() + fed / interval * width);
+    }
+  }
+  fed++;
+}
+
+void TimeRange::restart(){
+  for (size_t l = 0; l < slab.size(); l++){
+    clear(l);
+    entry[l] = zero.data();
+  }
+  fed = 0;
+}
+
+template <class T>
+static size_t vec_bytes(const vector<T>& v){
+  return v.size() * sizeof(T);
+}
+
+template <class T>
+static size_t vec_bytes(const vector<vector<T> >& v){
+  size_t total = 0;
+  for (size_t i = 0; i < v.size(); i++)
+    total += vec_bytes(v[i]);
+  return total;
+}
+
+template <class T>
+static size_t mat_bytes(const Matrix<T>& m){
+  return (size_t) m.rows() * m.stride() * sizeof(T);
+}
+
+size_t TimeRange::bytes() const {
+  size_t total = 0;
+  const Context* c[] = {&ctx, &replay};
+  for (int i = 0; i < 2; i++)
+    total += vec_bytes(c[i]->h) + vec_bytes(c[i]->state) + vec_bytes(c[i]->pre) + vec_bytes(c[i]->act) + vec_bytes(c[i]->o);
+  for (size_t l = 0; l < slab.size(); l++){
+    const Slab& v = slab[l];
+    total += vec_bytes(v.gates) + vec_bytes(v.inputs) + vec_bytes(v.input) + vec_bytes(v.output);
+    total += vec_bytes(v.state) + vec_bytes(v.index) + vec_bytes(v.dels) + vec_bytes(v.del_x) + vec_bytes(v.step);
+  }
+  for (size_t l = 0; l < grad.size(); l++)
+    total += mat_bytes(grad[l].w) + mat_bytes(grad[l].u) + vec_bytes(grad[l].b);
+  total += vec_bytes(log_index) + vec_bytes(log_target) + vec_bytes(ckpt_h) + vec_bytes(ckpt_state);
+  total += vec_bytes(carry_dels) + vec_bytes(carry_gates);
+  total += vec_bytes(del_y) + vec_bytes(tmp) + vec_bytes(zero) + vec_bytes(entry) + vec_bytes(wide_del) + vec_bytes(wide_x);
+  return total;
+}
+
+/* Mirrors the constructor and bytes() */
+size_t TimeRange::footprint(int l_num, int s, size_t inp, size_t n, int k, int c){
+  size_t ring = c ? c + 1 : s;
+  size_t saved = c ? s / c + 1 : 0;
+  size_t total = (l_num * 10 * n * k + inp * k) * sizeof(real) * (c ? 2 : 1);
+  for (int l = 0; l < l_num; l++){
+    size_t m = (l == 0) ? inp : n;
+    total += ring * (k * ((16 * n + m) * sizeof(real) + sizeof(int)) + sizeof(TimeStep));
+    total += 4 * n * (Matrix<accum>::padded(m) + Matrix<accum>::padded(n) + 1) * sizeof(accum);
+  }
+  total += (n * Matrix<accum>::padded(inp) + inp) * sizeof(accum);
+  if (c){
+    total += 2 * (s + 1) * k * sizeof(int);
+    total += l_num * (2 * saved + 9) * k * n * sizeof(real);
+  }
+  total += (2 * k * n + max(inp, 2 * n)) * sizeof(real) + l_num * sizeof(real*);
+  total += ring * k * (5 * n + max(inp, n)) * sizeof(accum);
+  return total;
+}
+
+/*
+l_num - the number of deep layers
+s - the number of timesteps for BPTT
+inp - dimensionality of input
+n - the number of hidden cells
+k - the number of streams
+c - the number of steps between checkpoints, 0 to hold every step
 */
-void Output::forward(TimeRange* t_store, vector<double>* y){
+TimeRange::TimeRange(int l_num, int s, size_t inp, size_t n, int k, int c): 
+                     max_size(c ? c + 1 : s), 
+                     window(s),
+                     interval(c),
+                     streams(k), 
+                     ctx(l_num, inp, n, k), 
+                     replay(l_num, inp, n, c ? k : 0),
+                     head(vector<int>(l_num, 0)),
+                     count(vector<int>(l_num, 0)),
+                     fed(0),
+                     log_index(vector<int>(c ? (s + 1) * k : 0)),
+                     log_target(vector<int>(c ? (s + 1) * k : 0)),
+                     ckpt_h(vector<vector<real> >(l_num, vector<real>(c ? (s / c + 1) * k * n : 0))),
+                     ckpt_state(vector<vector<real> >(l_num, vector<real>(c ? (s / c + 1) * k * n : 0))),
+                     carry_dels(vector<vector<real> >(l_num, vector<real>(c ? k * 5 * n : 0))),
+                     carry_gates(vector<vector<real> >(l_num, vector<real>(c ? k * 4 * n : 0))),
+                     del_y(vector<real>(k * n)),
+                     tmp(vector<real>(max(inp, 2 * n))),
+                     zero(vector<real>(k * n, 0.0)),
+                     entry(vector<const real*>(l_num)),
+                     wide_del(vector<accum>(max_size * k * 5 * n)),
+                     wide_x(vector<accum>(max_size * k * max(inp, n))) { 
+  if (c < 0)
+    throw runtime_error("Checkpoint interval must not be negative");
+  for (int l = 0; l < l_num; l++){
+    slab.push_back(Slab(max_size, (l == 0) ? inp : n, n, k));
+    grad.push_back(Gradient((l == 0) ? inp : n, n, 4 * n, 4 * n));
+    entry[l] = zero.data();
+  }
+  grad.push_back(Gradient(inp, 0, n, inp));
+}
+
+/*
+s - width of the input weights
+n - width of the recurrent weights, 0 without any
+r - rows of both
+bias - the number of biases
+*/
+Gradient::Gradient(size_t s, size_t n, size_t r, size_t bias): 
+                   w(Matrix<accum>(s, r)), 
+                   u(Matrix<accum>(n, r)), 
+                   b(vector<accum>(bias, 0.0)) { }
+
+void Gradient::clear(){
+  w.fill(0.0);
+  u.fill(0.0);
+  b.assign(b.size(), 0.0);
+}
 
-  vector<double> out = vector<double>(inp_size, 0.0);
-  Matrix<double> xt = w.h_prod(outer(x, vector<double>(inp_size, 1.0)));
-  vector<double> weighted = xt.mat_sum_y();
-  out = out + weighted + b;
-  //use the softmax for output 
-  //TODO potentially fix for clarity
-  double weighted_sum;
-  for (size_t i = 0; i < weighted.size(); i++)
-    weighted_sum += exp(out[i]);
-  for (size_t i = 0; i < weighted.size(); i++)
-    out[i] = abs(exp(out[i]) / weighted_sum);
+Gradient& Gradient::operator+=(const Gradient& g){
+  w.axpy(1.0, g.w);
+  u.axpy(1.0, g.u);
+  kernels<accum>().axpy(1.0, g.b.data(), b.data(), b.size());
+  return *this;
+}
 
-  o = out;
-  //the delta of the final 
-  if (y && t_store)
-    t_store->back(t_store->q.size() - 1)->del_x = (calc_delta(*y).mat_sum_x()) / inp_size;
+/* Data as accum; only copied (through buf) when accum is wider than real */
+static inline const real* widen(const real* p, vector<real>&, size_t){
+  return p;
+}
 
+template <class A>
+static inline const A* widen(const real* p, vector<A>& buf, size_t n){
+  buf.assign(p, p + n);
+  return buf.data();
+}
+
+/* w -= rate * g, row by row as the two may differ in type and stride */
+template <class A>
+static void apply_grad(Matrix<real>& w, const Matrix<A>& g, double rate){
+  for (int i = 0; i < w.rows(); i++){
+    real* r = w[i];
+    const A* d = g[i];
+    for (int j = 0; j < w.cols(); j++)
+      r[j] -= rate * d[j];
+  }
+}
+
+/* 
+Produce output from the network
+x holds the top block output of every stream
+One kernel call per stream covers the logits, a stable softmax, the loss and the delta
+*/
+void Output::forward(Context& ctx, TimeRange* t_store, const real* x, const int* y){
+  const Kernels<real>& k = kernels<real>();
+  size_t s = inp_size;
+  size_t n = block_num;
+  //the delta of the final layer, dE/dh = W (o - y), kept normalised by the output size
+  real* del_x = (y && t_store) ? t_store->back(t_store->layers() - 1)->del_x : NULL;
+
+  for (int j = 0; j < ctx.streams; j++){
+    int target = y ? y[j] : -1;
+    real ly = 0;
+    real z = k.output(w.data(), n, s, w.stride(), b.data(), x + j * n, ctx.o.data() + j * s, 
+                      target, del_x ? del_x + j * n : NULL, &ly);
+    if (target >= 0){
+      ctx.loss += log(z) - ly;
+      ctx.scored++;
+    }
+  }
+  if (del_x)
+    for (size_t i = 0; i < ctx.streams * n; i++)
+      del_x[i] /= s;
 }
 
 /* 
 Generate the gradient dE/dyt 
+Summed over the streams, from the top block output and the distribution of their last step
 */
-void Output::backprop(vector<double> y, double rate, double lambda){
-  //calculate weight delta
-  Matrix<double> delt = calc_delta(y);
+void Output::backprop(TimeRange* t_store, const int* y){
+  const Context& ctx = t_store->ctx;
+  Gradient& grad = t_store->grad.back();
+  size_t s = inp_size;
+  const real* x = ctx.h.back().data();
+  vector<real>& err = t_store->tmp;
+  vector<accum>& wide_err = t_store->wide_del;
+  vector<accum>& wide_x = t_store->wide_x;
+
+  grad.clear();
+  for (int k = 0; k < ctx.streams; k++){
+    copy(ctx.o.begin() + k * s, ctx.o.begin() + (k + 1) * s, err.begin());
+    if (y[k] >= 0)
+      err[y[k]] -= 1.0;
+
+    const accum* e = widen(err.data(), wide_err, s);
+    grad.w.add_outer(1.0, widen(x + k * block_num, wide_x, block_num), e);
+    kernels<accum>().axpy(1.0, e, grad.b.data(), s);
+  }
+}
 
-  //update weights
-  w = w - (delt - (w * lambda)) * rate;
-  b = b - (o - y) * rate;
+/* Update the weights from a gradient summed over streams */
+void Output::apply(const Gradient& grad, double rate, double lambda, int streams){
+  w *= 1 - rate * lambda * streams;
+  apply_grad(w, grad.w, rate);
+  for (size_t i = 0; i < inp_size; i++)
+    b[i] -= rate * grad.b[i];
 }
 
-Output::Output(size_t s, size_t n): inp_size(s), block_num(n), w(Matrix<double>(s, n)), b(vector<double>(s, 1.0)) {
-  w.randomize();
+Output::Output(size_t s, size_t n, bool init): inp_size(s), block_num(n), w(Matrix<real>(s, n)), b(vector<real>(s, 1.0)) {
+  if (init)
+    w.randomize();
 }
 
 Output::~Output() { }
@@ -133,46 +351,70 @@ Output::~Output() { }
 
 /*
 Feed specific cell forward
-x is input at time step t
+x is input at time step t, one row per stream, or index gives one-hot inputs
 return the output for the memory cell
 */
-void Block::forward(TimeRange* t_store, vector<double>* y){
-  vector<double> inp_z = (w[3] * x) + (u[3] * h) + b[3];
-  vector<double> inp_i = (w[1] * x) + (u[1] * h) + b[1];
-  vector<double> inp_f = (w[0] * x) + (u[0] * h) + b[0];
-  vector<double> inp_o = (w[2] * x) + (u[2] * h) + b[2];
-
-  vector<double> z_gate = activate(inp_z, &tanh);
-  vector<double> i_gate = activate(inp_i, &sigmoid);
-  vector<double> f_gate = activate(inp_f, &sigmoid);
-  vector<double> o_gate = activate(inp_o, &tanh);
-
-  state = h_prod(f_gate, state_prev) + h_prod(i_gate, z_gate);
-  vector<double> out = h_prod(o_gate, activate(state, &sigmoid));
-
-  //chain timesteps together
-  h = out;
-  state_prev = state;
-
-  //create the timestep and include relevant data
-  //if the pass is a training run
-  if (t_store){
-
-    vector<vector<double> > gates = {z_gate, i_gate, f_gate, o_gate};
-    vector<vector<double> > inputs = {inp_z, inp_i, inp_f, inp_o};
-    t_store->push(id, TimeStep(gates, inputs, x, out, state, block_num));
+void Block::forward(Context& ctx, TimeRange* t_store, const real* x, const int* index, const int* y){
+  size_t n = block_num;
+  size_t g = 4 * n;
+  int streams = ctx.streams;
+  real* h = ctx.h[id].data();
+  real* state = ctx.state[id].data();
+
+  //a training pass works straight in its next time step, anything else in the context scratch
+  TimeStep* step = t_store ? t_store->push(id) : NULL;
+  real* pre = step ? step->inputs : ctx.pre[id].data();
+  real* act = step ? step->gates : ctx.act[id].data();
+
+  //every gate's pre-activation from two stacked products, each weight read once for all streams
+  //a one-hot input only selects a column of w, read as a row of its transpose
+  const Kernels<real>& kr = kernels<real>();
+  const FixedKernels<real>* fk = (shape >= 0 && streams > 1) ? &kr.fixed[shape] : NULL;
+  if (index){
+    for (int k = 0; k < streams; k++){
+      real* p = pre + k * g;
+      if (index[k] < 0)
+        fill(p, p + g, 0.0);
+      else
+        copy(wt[index[k]], wt[index[k]] + g, p);
+    }
+  } else if (fk && inp_size == n){
+    fk->gemm_u(w.data(), w.stride(), x, inp_size, pre, g, streams, false);
+  } else {
+    w.gemm(x, inp_size, pre, g, streams);
+  }
+  if (fk)
+    fk->gemm_u(u.data(), u.stride(), h, n, pre, g, streams, true);
+  else
+    u.gemm(h, n, pre, g, streams, true);
+
+  //bias, activations, state = f o state_prev + i o z, h = o o sigmoid(state)
+  //the state is updated in place, the previous one is kept by the last timestep
+  for (int k = 0; k < streams; k++){
+    if (fk)
+      fk->lstm_cell(pre + k * g, b.data(), state + k * n, act + k * g, state + k * n, h + k * n);
+    else
+      kr.lstm_cell(pre + k * g, b.data(), state + k * n, act + k * g, state + k * n, h + k * n, n);
+  }
 
+  //fill in the rest of the timestep
+  if (step){
+    step->sparse = (index != NULL);
+    if (index)
+      copy(index, index + streams, step->index);
+    else
+      copy(x, x + streams * inp_size, step->input);
+    copy(h, h + streams * n, step->output);
+    copy(state, state + streams * n, step->state);
   }
 
   //pass to output node
   //potentially chained blocks
   if (next){
-    next->x = out;
-    next->forward(t_store, y);
+    next->forward(ctx, t_store, h, NULL, y);
   } 
   else if (out_node) {
-    out_node->x = out;
-    out_node->forward(t_store, y);
+    out_node->forward(ctx, t_store, h, y);
   } else {
     cerr << "Network formatted incorrectly" << endl;
   }
@@ -183,75 +425,162 @@ Perform BPTT
 Uses t as a record of previous values in the timeseries
 h - the output of the block in the forward pass
 err - the gradient calculated from the previous layer
+Deltas are kept stacked like the weights (z i f o, then c), so each product
+against w or u is a single transposed product over every stream
 */
-void Block::backprop(TimeRange* t_store, int block_size, double rate, double lambda){
+void Block::backprop(TimeRange* t_store, int block_size){
+  const Kernels<real>& k = kernels<real>();
+  size_t n = block_num;
+  size_t g = 4 * n;
+  size_t d = 5 * n;
+  int streams = t_store->streams;
+  vector<real>& del_y = t_store->del_y;
+  vector<real>& tmp = t_store->tmp;
 
   //calculate gate and output deltas
   for (int t = t_store->size(id) - 2; t >= 0; t--){
     TimeStep* curr = t_store->get(id, t);
-    TimeStep* prev = t_store->get(id, t - 1);
     TimeStep* next = t_store->get(id, t + 1); 
     TimeStep* prev_layer = (id > 0) ? t_store->get(id - 1, t) : NULL;
+    //the state before the first held step comes from a checkpoint, or is taken as zero
+    const real* prev_state = (t > 0) ? t_store->get(id, t - 1)->state : t_store->entry[id];
+
+    //del_y = (del_x + transpose(u) * next deltas) / block_size
+    copy(curr->del_x, curr->del_x + streams * n, del_y.begin());
+    u.gemm_t(next->dels, d, del_y.data(), n, streams, true);
+    del_y /= block_size;
+
+    //gate derivatives come from the stored activations, only tanh(state) is evaluated
+    real* t_c = tmp.data() + n;
+    for (int s = 0; s < streams; s++){
+      real* del = curr->dels + s * d;
+      const real* gate = curr->gates + s * g;
+      const real* state = curr->state + s * n;
+      const real* dy = del_y.data() + s * n;
+
+      //del_o = del_y o tanh(state) o tanh'(inp_o)
+      k.activate[TANH](state, t_c, n);
+      k.h_prod(dy, t_c, del + O * n, n);
+      k.activate[DERIV_TANH_OUT](gate + O * n, tmp.data(), n);
+      k.h_prod(del + O * n, tmp.data(), del + O * n, n);
+      for (size_t j = 0; j < n; j++)
+        del[O * n + j] /= block_size;
+
+      //del_c = del_y o del_o o tanh'(state) + next del_c o next f
+      k.activate[DERIV_TANH_OUT](t_c, tmp.data(), n);
+      k.h_prod(tmp.data(), del + O * n, tmp.data(), n);
+      k.h_prod(tmp.data(), dy, del + C * n, n);
+      k.h_prod_add(next->dels + s * d + C * n, next->gates + s * g + F * n, del + C * n, n);
+      for (size_t j = 0; j < n; j++)
+        del[C * n + j] /= block_size;
+
+      //del_f = del_c o prev state o sigmoid'(inp_f)
+      k.activate[DERIV_SIGMOID_OUT](gate + F * n, tmp.data(), n);
+      k.h_prod(tmp.data(), prev_state + s * n, tmp.data(), n);
+      k.h_prod(tmp.data(), del + C * n, del + F * n, n);
+
+      //del_i = del_c o z o sigmoid'(inp_i)
+      k.activate[DERIV_SIGMOID_OUT](gate + I * n, tmp.data(), n);
+      k.h_prod(tmp.data(), gate + Z * n, tmp.data(), n);
+      k.h_prod(tmp.data(), del + C * n, del + I * n, n);
+
+      //del_z = del_c o i o tanh'(inp_z)
+      k.activate[DERIV_TANH_OUT](gate + Z * n, tmp.data(), n);
+      k.h_prod(tmp.data(), gate + I * n, tmp.data(), n);
+      k.h_prod(tmp.data(), del + C * n, del + Z * n, n);
+
+      for (size_t j = 0; j < 3 * n; j++)
+        del[Z * n + j] /= block_size;
+    }
 
-    vector<double> del_y = (curr->del_x
-                            + (u[0] * next->dels[F])
-                            + (u[1] * next->dels[I])
-                            + (u[2] * next->dels[O])
-                            + (u[3] * next->dels[Z]))
-                            / block_size;
-
-
-    vector<double> del_o = h_prod(h_prod(del_y, activate(curr->state, &tanh)), activate(curr->inputs[O], &deriv_tanh)) / block_size;
-    vector<double> del_c = (h_prod(del_y, h_prod(del_o, activate(curr->state, &deriv_tanh)))
-                                 + h_prod(next->dels[C], next->gates[F])) / block_size;
-    vector<double> del_f = h_prod(del_c, h_prod(prev->state, activate(curr->inputs[F], &deriv_sigmoid))) / block_size;
-    vector<double> del_i = h_prod(del_c, h_prod(curr->gates[Z], activate(curr->inputs[I], &deriv_sigmoid))) / block_size;
-    vector<double> del_z = h_prod(del_c, h_prod(curr->gates[I], activate(curr->inputs[Z], &deriv_tanh))) / block_size;
-
+    //pass the input delta to the previous layer
     if (prev_layer){
-      vector<double> inp_del = (w[0].mult_x(del_f)
-                             + w[1].mult_x(del_i)
-                             + w[2].mult_x(del_o)
-                             + w[3].mult_x(del_z))
-                             / block_size;
-      prev_layer->del_x = inp_del;
+      w.gemm_t(curr->dels, d, prev_layer->del_x, inp_size, streams);
+      for (size_t j = 0; j < streams * inp_size; j++)
+        prev_layer->del_x[j] /= block_size;
     }
-    
-                    
-    //set the new values in the timestep
-    curr->set_delts(del_z, del_i, del_f, del_o, del_c);
   }
 
-
-  //calculate and apply deltas for final weights
-  for (int i = 0; i < 4; i++){
-    Matrix<double> del_w = Matrix<double>(inp_size, block_num, 0.0);
-    Matrix<double> del_u = Matrix<double>(block_num, block_num, 0.0);
-    vector<double> del_b = vector<double>(block_num, 0.0);
-
-    //calculate
-    for (int t = 0; t < t_store->size(id); t++){
-      TimeStep* curr = t_store->get(id, t);
-    
-      //update the weights for each gate
-      del_w = del_w + outer(curr->dels[i], curr->input);
-      
-      //update the recurrent weights for each gate
-      if (t < t_store->size(id) - 1) {
-        TimeStep* curr_t1 = t_store->get(id, t + 1);
-        del_u = del_u + outer(curr_t1->dels[i], curr->output);
+  //calculate deltas for the stacked weights
+  const Kernels<accum>& ka = kernels<accum>();
+  vector<accum>& wide_del = t_store->wide_del;
+  vector<accum>& wide_x = t_store->wide_x;
+  Gradient& grad = t_store->grad[id];
+  Matrix<accum>& del_w = grad.w;
+  Matrix<accum>& del_u = grad.u;
+
+  //each slab holds one row per step and stream, in step order up to the end of the ring
+  //so every run of slots is one rank-(steps x streams) update instead of one per step
+  //the last step's deltas are either zero or counted by the later segment they came from
+  int size = t_store->size(id);
+  for (int t = 0, len; t < size - 1; t += len){
+    TimeStep* curr = t_store->get(id, t);
+    len = min(size - 1 - t, t_store->contiguous(id, t));
+    for (int j = 1; j < len; j++)
+      if (t_store->get(id, t + j)->sparse != curr->sparse)
+        len = j;
+    size_t rows = len * streams;
+    const accum* del = widen(curr->dels, wide_del, rows * d);
+
+    //update the weights for each gate
+    //a one-hot input only touches its own column
+    if (curr->sparse){
+      for (size_t p = 0; p < rows; p++){
+        int c = curr->index[p];
+        if (c >= 0)
+          for (size_t r = 0; r < g; r++)
+            del_w[r][c] += del[p * d + r];
       }
-      
-      del_b = del_b + curr->dels[i]; 
+    } else {
+      del_w.add_outer(1.0, del, d, widen(curr->input, wide_x, rows * inp_size), inp_size, rows);
     }
 
-    //apply
-    w[i] = w[i] - (del_w * (rate)) - w[i] * (rate * lambda); 
-    u[i] = u[i] - (del_u * (rate)) - u[i] * (rate * lambda); 
-    b[i] = b[i] - del_b * (rate);
+    for (size_t p = 0; p < rows; p++)
+      ka.axpy(1.0, del + p * d, grad.b.data(), g);
   }
 
-  t_store->clear(id);
+  //update the recurrent weights for each gate, pairing each output with the next step's deltas
+  for (int t = 0, len; t + 1 < size; t += len){
+    len = min(size - 1 - t, min(t_store->contiguous(id, t), t_store->contiguous(id, t + 1)));
+    size_t rows = len * streams;
+    const accum* del = widen(t_store->get(id, t + 1)->dels, wide_del, rows * d);
+    del_u.add_outer(1.0, del, d, widen(t_store->get(id, t)->output, wide_x, rows * n), n, rows);
+  }
+}
+
+/*
+Update the weights from a gradient summed over streams
+Decays once per stream, so every character moves the weights as it would alone
+*/
+void Block::apply(const Gradient& grad, double rate, double lambda, int streams){
+  w *= 1 - rate * lambda * streams;
+  apply_grad(w, grad.w, rate);
+  u *= 1 - rate * lambda * streams;
+  apply_grad(u, grad.u, rate);
+  for (size_t r = 0; r < 4 * block_num; r++)
+    b[r] -= rate * grad.b[r];
+  transpose_input();
+}
+
+void Block::transpose_input(){
+  if (id != 0)
+    return;
+  size_t g = 4 * block_num;
+  for (size_t r = 0; r < g; r++){
+    const real* row = w[r];
+    for (size_t c = 0; c < inp_size; c++)
+      wt[c][r] = row[c];
+  }
+}
+
+/* View of one gate's rows of the stacked input weights */
+MatrixView<real> Block::gate_w(int g){
+  return w.block(0, g * block_num, inp_size, block_num);
+}
+
+/* View of one gate's rows of the stacked recurrent weights */
+MatrixView<real> Block::gate_u(int g){
+  return u.block(0, g * block_num, block_num, block_num);
 }
 
 /*
@@ -260,29 +589,26 @@ s - dimensionality of input vectors
 */
 Block::Block(int i, 
       size_t s, 
-      size_t n): 
+      size_t n,
+      bool init): 
       id(i),
+      out_node(NULL),
+      next(NULL),
       inp_size(s), 
       block_num(n),
-      h(vector<double>(n, 0.0)),
-      state(vector<double>(n, 0.0)),
-      state_prev(vector<double>(n, 0.0)),
-      out_node(NULL),
-      next(NULL) {
+      shape(-1),
+      w(Matrix<real>(s, 4 * n)),
+      u(Matrix<real>(n, 4 * n)),
+      b(vector<real>(4 * n, 0.0)),
+      wt(i == 0 ? Matrix<real>(4 * n, s) : Matrix<real>()) {
   
   //initialize weights
-  for(int i = 0; i < 4; i++){
-    w[i] = Matrix<double>(s, n);
-    u[i] = Matrix<double>(n, n);
-    b[i] = vector<double>(n, 0.0);
+  if (init){
+    w.randomize();
+    u.randomize();
   }
-
-  for (int i = 0; i < 4; i++)
-    w[i].randomize();
-
-  //initialize u
-  for (int i = 0; i < 4; i++)
-    u[i].randomize();  }
+  transpose_input();
+}
 
 Block::~Block() {
   delete next;
@@ -293,9 +619,21 @@ Block::~Block() {
 /*
  Pass the current time input to the hidden layer
 */
-void Input::forward(TimeRange* t_store, vector<double> xt, vector<double>* y){
-  next->x = xt;
-  next->forward(t_store, y);
+void Input::forward(Context& ctx, TimeRange* t_store, const vector<real>& xt, const int* y){
+  if (xt.size() != ctx.streams * next->inp_size)
+    throw runtime_error("Block input not aligned");
+  next->forward(ctx, t_store, xt.data(), NULL, y);
+}
+
+/*
+ Pass a one-hot input by index
+ An index without a slot (an unmapped character) is an all-zero input
+*/
+void Input::forward(Context& ctx, TimeRange* t_store, const int* index, const int* y){
+  for (int k = 0; k < ctx.streams; k++)
+    if (index[k] >= (int) next->inp_size)
+      throw runtime_error("Input index out of range");
+  next->forward(ctx, t_store, NULL, index, y);
 }
 
 Input::Input(): next(NULL) { }
@@ -308,55 +646,300 @@ Input::~Input() {
     1. Feed information up to block_size
     2. When block_size is reached, backpropagate through the current TimeRange structure
 */
-void Net::train(double rate, double lambda, int limit){
-  cout << "Training . . . " << endl;
-  for(size_t i = 0; (i < data->length() && i < limit); i++){
-    //feed intial character vector into the network
-    vector<double> curr = vectorize((*data)[i]);
-    vector<double> curr_p1 = vectorize((*data)[i + 1]);
-    input->forward(time_vals, curr, &curr_p1);
+void Net::train(double rate, double lambda, size_t limit){
+  train(rate, lambda, limit, 1, 1, SYNC);
+}
+
+/*
+  The data is cut into one contiguous slice per stream
+  Every step feeds the next character of each slice, so the streams share each weight read
+*/
+void Net::train(double rate, double lambda, size_t limit, int streams){
+  train(rate, lambda, limit, streams, 1, SYNC);
+}
+
+/* Holds threads until all of them have arrived, then lets them go together */
+struct Barrier {
+  mutex m;
+  condition_variable cv;
+  int count;
+  int waiting;
+  int generation;
+
+  void wait(){
+    unique_lock<mutex> lock(m);
+    int gen = generation;
+    if (++waiting == count){
+      waiting = 0;
+      generation++;
+      cv.notify_all();
+    } else {
+      cv.wait(lock, [&]{ return gen != generation; });
+    }
+  }
+
+  Barrier(int c): count(c), waiting(0), generation(0) { }
+};
+
+/* Apply the gradients held by a TimeRange to every layer */
+static void apply_all(Net* net, TimeRange* t_store, double rate, double lambda, int streams){
+  net->output->apply(t_store->grad.back(), rate, lambda, streams);
+  for (size_t k = 0; k < net->block.size(); k++)
+    net->block[k]->apply(t_store->grad[k], rate, lambda, streams);
+}
+
+/*
+Record the steps taken at the end of a window, saving if one is due
+Called by the first worker once the window's gradients are applied
+*/
+static void progress(Net* net, Checkpointer* saver, size_t steps, int streams, int threads){
+  net->cursor.step = steps;
+  net->cursor.chars = steps * streams * threads;
+  if (saver)
+    saver->tick(net, steps);
+}
+
+/*
+One training worker, feeding its own streams through its own TimeRange
+Stream k of worker w reads the slice starting at (w * streams + k) * span, from step first
+SYNC workers meet at the end of every window, where the first sums every gradient and applies it
+while the rest wait; HOGWILD workers apply their own gradients straight to the shared weights
+Saves are taken by the first worker at the end of a window, while SYNC workers are still waiting,
+and copied while the next window is fed; HOGWILD saves may mix in other workers' updates
+*/
+static void train_worker(Net* net, const Corpus* text, int id, size_t first, size_t span, double rate, double lambda, 
+                         size_t limit, Combine mode, Barrier* sync, Checkpointer* saver){
+  TimeRange* t_store = net->time_vals[id];
+  int streams = t_store->streams;
+  int threads = net->time_vals.size();
+  //the worker's slices arrive already encoded, read ahead on another thread
+  Prefetcher slices(text, (size_t) id * streams * span, span, streams, first, span);
+  const int* curr;
+  const int* curr_p1;
+
+  for(size_t i = first; i < span; i++){
+    //feed the current character of every stream into the network
+    slices.step(curr, curr_p1);
+    net->step(t_store, curr, curr_p1);
 
     //backpropagate throughout the deep layers
-    if (i % (int) block_size == 0 && i != 0){
-      output->backprop(curr, rate, lambda);
-      for (int k = block.size() - 1; k >= 0; --k){
-        block[k]->backprop(time_vals, block_size, rate, lambda);   
+    if (i % (int) net->block_size == 0 && i != 0){
+      net->backprop(t_store, curr_p1);
+
+      //a save taken at the last window may still be copying the weights
+      if (id == 0 && saver)
+        saver->settle();
+      if (mode == HOGWILD){
+        apply_all(net, t_store, rate, lambda, streams);
+        if (id == 0)
+          progress(net, saver, i + 1, streams, threads);
+      } else {
+        sync->wait();
+        if (id == 0){
+          for (int w = 1; w < threads; w++)
+            for (size_t l = 0; l < t_store->grad.size(); l++)
+              t_store->grad[l] += net->time_vals[w]->grad[l];
+          apply_all(net, t_store, rate, lambda, streams * threads);
+          progress(net, saver, i + 1, streams, threads);
+        }
+        sync->wait();
       }
     }
 
     //print only occasionally to avoid slowdowns
-    if (i % 100 == 0){
-     cout << "\r" << i;
-     cout << " " << ((double) i / limit) * 100.0 << "%";
+    //the loss is this worker's mean over the steps since the last print
+    if (id == 0 && i % 100 == 0){
+     cout << "\r" << i * streams * threads;
+     cout << " " << ((double) i * streams * threads / limit) * 100.0 << "%";
+     cout << " loss " << t_store->ctx.take_loss() << "    ";
      fflush(stdout);
     }
   }
+}
+
+void Net::train(double rate, double lambda, size_t limit, int streams, int threads, Combine mode){
+  if (streams < 1 || threads < 1)
+    throw runtime_error("Training needs at least one stream and thread");
+
+  //one TimeRange per worker, built by the first training run and kept while the layout stays the same
+  if (time_vals.size() != (size_t) threads || time_vals[0]->streams != streams ||
+      time_vals[0]->interval != checkpoint){
+    for (TimeRange* t : time_vals)
+      delete t;
+    time_vals.clear();
+    for (int w = 0; w < threads; w++)
+      time_vals.push_back(new TimeRange(layer_num, block_size, inp_size, node_num, streams, checkpoint));
+  }
+  //steps an earlier run left short of a full window are not carried into this one
+  for (TimeRange* t : time_vals)
+    t->restart();
+  //a file corpus when there is one, the data string otherwise
+  Corpus own(data);
+  const Corpus* text = corpus ? corpus : &own;
+  size_t span = min(text->length(), limit) / (streams * threads);
+  Barrier sync(threads);
+
+  //mapped weights are read-only, so training works on copies of its own
+  if (mapping){
+    for (Block* blk : block){
+      blk->w.own();
+      blk->u.own();
+    }
+    output->w.own();
+    delete mapping;
+    mapping = NULL;
+  }
+
+  //resume a run saved part way through with the same limit and layout, otherwise start over
+  size_t first = 0;
+  if (cursor.limit == limit && cursor.streams == streams && cursor.threads == threads && 
+      cursor.step < span)
+    first = cursor.step;
+  cursor.step = first;
+  cursor.chars = first * streams * threads;
+  cursor.limit = limit;
+  cursor.rate = rate;
+  cursor.lambda = lambda;
+  cursor.streams = streams;
+  cursor.threads = threads;
+  Checkpointer* saver = save_path.empty() ? NULL : new Checkpointer(save_path, save_every, save_seconds);
+
+  cout << "Training . . . " << endl;
+  cout << "BPTT history " << time_vals[0]->bytes() / 1048576.0 << " MB per worker";
+  if (checkpoint)
+    cout << ", checkpointed every " << checkpoint << " steps";
+  if (first)
+    cout << ", resuming at step " << first;
+  cout << endl;
+  if (threads == 1){
+    train_worker(this, text, 0, first, span, rate, lambda, limit, mode, &sync, saver);
+  } else {
+    vector<thread> pool;
+    for (int w = 0; w < threads; w++)
+      pool.push_back(thread(train_worker, this, text, w, first, span, rate, lambda, limit, mode, &sync, saver));
+    for (thread& t : pool)
+      t.join();
+  }
 
   trained = true;
+  cursor.step = span;
+  cursor.chars = span * streams * threads;
+  if (saver){
+    //the final save waits for any in progress and is left out of the counts
+    saver->flush();
+    SaveStats stats = saver->stats;
+    saver->take(this);
+    saver->flush();
+    stats.failed = saver->stats.failed;
+    stats.write_total = saver->stats.write_total;
+    save_stats = stats;
+    delete saver;
+
+    cout << endl << "Saved to " << save_path << " " << stats.saves << " times while training and once at the end";
+    cout << " (" << stats.skipped << " skipped, " << stats.failed << " failed)";
+    if (stats.saves)
+      cout << ", training stalled " << 1e6 * stats.stall_total / stats.saves << " us per save on average, " 
+           << 1e6 * stats.stall_max << " us at most";
+    cout << endl;
+  }
+}
+
+/*
+Feed one character of every stream through a training TimeRange
+A checkpointed TimeRange keeps no history here, backprop recomputes it
+*/
+void Net::step(TimeRange* t_store, const int* index, const int* y){
+  t_store->record(index, y);
+  input->forward(t_store->ctx, t_store->interval ? NULL : t_store, index, y);
 }
 
+/*
+Every layer's gradient is summed over the held steps, top layer first
+A checkpointed window is replayed one segment at a time, latest first, from the
+checkpoint before it; the first step of each segment is kept and pushed after the
+end of the segment before it, carrying its deltas back
+*/
+void Net::backprop(TimeRange* t_store, const int* y){
+  output->backprop(t_store, y);
+  for (size_t l = 0; l < layer_num; l++)
+    t_store->grad[l].clear();
+
+  if (!t_store->interval){
+    for (int l = layer_num - 1; l >= 0; l--)
+      block[l]->backprop(t_store, block_size);
+    for (size_t l = 0; l < layer_num; l++)
+      t_store->clear(l);
+    return;
+  }
 
-string Net::run(size_t length, string s){
+  int c = t_store->interval;
+  int k = t_store->streams;
+  int steps = t_store->fed;
+  size_t width = k * node_num;
+  Context& ctx = t_store->replay;
+  for (int seg = (steps - 1) / c; seg >= 0; seg--){
+    int first = seg * c;
+    int last = min(steps, first + c);
+    for (size_t l = 0; l < layer_num; l++){
+      t_store->clear(l);
+      const real* h = &t_store->ckpt_h[l][seg * width];
+      const real* state = &t_store->ckpt_state[l][seg * width];
+      copy(h, h + width, ctx.h[l].begin());
+      copy(state, state + width, ctx.state[l].begin());
+      //as in a full window, the state before the window is taken as zero
+      t_store->entry[l] = seg ? state : t_store->zero.data();
+    }
+    for (int t = first; t < last; t++)
+      input->forward(ctx, t_store, &t_store->log_index[t * k], &t_store->log_target[t * k]);
+    if (last < steps){
+      for (size_t l = 0; l < layer_num; l++){
+        TimeStep* next = t_store->push(l);
+        copy(t_store->carry_dels[l].begin(), t_store->carry_dels[l].end(), next->dels);
+        copy(t_store->carry_gates[l].begin(), t_store->carry_gates[l].end(), next->gates);
+      }
+    }
+
+    for (int l = layer_num - 1; l >= 0; l--)
+      block[l]->backprop(t_store, block_size);
+
+    for (size_t l = 0; l < layer_num; l++){
+      TimeStep* carry = t_store->get(l, 0);
+      copy(carry->dels, carry->dels + 5 * width, t_store->carry_dels[l].begin());
+      copy(carry->gates, carry->gates + 4 * width, t_store->carry_gates[l].begin());
+    }
+  }
+
+  t_store->restart();
+}
+
+/*
+Checkpointing recomputes the window once whatever the interval, so the largest
+interval that fits is picked for the widest gradient updates
+*/
+int Net::plan_checkpoint(size_t budget, int streams){
+  if (TimeRange::footprint(layer_num, block_size, inp_size, node_num, streams, 0) <= budget)
+    return 0;
+  for (int c = block_size; c > 0; c--)
+    if (TimeRange::footprint(layer_num, block_size, inp_size, node_num, streams, c) <= budget)
+      return c;
+  throw runtime_error("BPTT window does not fit the memory budget");
+}
+
+void Net::feed(char c){
+  int index = char_index(c);
+  input->forward(*context, NULL, &index, NULL);
+}
+
+string Net::run(size_t length, string s, const SampleParams& params){
   if (!trained){
     cerr << "The network hasn't been trained yet." << endl;
     return "";
   }
-  string out = s;
-  //feed the starting string through the network, ignoring output
-  input->forward(NULL, vectorize(s[0]), NULL);
-  for(size_t i = 1; i < s.length() - 1; i++){
-    input->forward(NULL, vectorize(s[i]), NULL);
-  }
-  vector<double> curr = output->o;
-
-  while(length-- > 0){
-    input->forward(NULL, curr, NULL);
-    
-    char next = pick_char(output->o);
-    curr = vectorize(next);
-    //print_vector(output->o);
-    out += next;
-  }
+  //generated by an inference copy, each picked character fed back in as the next input
+  Frozen frozen(*this);
+  frozen.sampler.params = params;
+  string out = s + string(length, ' ');
+  frozen.generate(s.data(), s.length(), &out[s.length()], length);
   cout << out << endl;
   return out;
 }
@@ -367,26 +950,34 @@ l - the number of deep layers
 s - dimensionality of input
 n - the number of hidden cells
 b - the number of timesteps for BPTT
+init - false when the weights are about to be loaded
 */
 Net::Net(string* i, 
          size_t l, 
          size_t s, 
          size_t n, 
-         int b): 
+         int b,
+         bool init): 
          layer_num(l),
          inp_size(s),
          node_num(n),
-         block_size(b){
+         block_size(b),
+         checkpoint(0),
+         trained(false),
+         save_every(0),
+         save_seconds(0){
   data = i;
-  time_vals = new TimeRange(l, b);
+  corpus = NULL;
+  mapping = NULL;
+  context = new Context(l, s, n, 1);
   input = new Input();
-  output = new Output(s, n);
+  output = new Output(s, n, init);
 
   //set up chained block layers
   for (size_t k = 0; k < l; k++){
     //only the first block has the input size of the network input
     int block_inp_size = (k == 0) ? s : n;
-    Block* curr_block = new Block(k, block_inp_size, n);
+    Block* curr_block = new Block(k, block_inp_size, n, init);
     block.push_back(curr_block); 
     if (k > 0)
       block[k - 1]->next = curr_block;
@@ -395,13 +986,23 @@ Net::Net(string* i,
   }
 
   input->next = block[0];
+  specialize();
+}
+
+void Net::specialize(bool fixed){
+  int shape = fixed ? fixed_shape<real>(node_num) : -1;
+  for (Block* blk : block)
+    blk->shape = shape;
 }
 
 Net::~Net() {
-  delete time_vals;
+  for (TimeRange* t : time_vals)
+    delete t;
+  delete context;
+  //blocks are owned by the chain starting at the input
   delete input;
-  for (Block* b : block)
-    delete b;
   delete output;
   delete data;
+  delete corpus;
+  delete mapping;
 }
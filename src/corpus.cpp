@@ -0,0 +1,315 @@
+/*******************************************************************************
+ * Name        : corpus.cpp
+ * Author      : Ben Blease
+ * Date        : 11/4/17
+ * Description : Training text streamed from disk and encoded ahead of use
+ ******************************************************************************/
+
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "corpus.h"
+#include "core.h"
+
+using namespace std;
+
+/*
+Cache file layout, version 1
+  header, padded out to CACHE_OFFSET
+  one index byte per character, CORPUS_NONE for characters without one
+The header keeps the character of every index, so a cache is only read with the encoding
+it was made with, and the size and time of the text it was made from, to tell when it is stale
+*/
+#define CACHE_MAGIC "RNNCORPS"
+#define CACHE_VERSION 1
+#define CACHE_ENDIAN 0x01020304u
+#define CACHE_OFFSET 4096 //a page, so the indices map aligned
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian; //CACHE_ENDIAN as the writer stored it
+  uint64_t source_size;
+  int64_t source_time;
+  uint32_t vocab; //indices in use
+  char chars[256]; //character of each index
+  CorpusStats stats;
+};
+
+static_assert(sizeof (CacheHeader) <= CACHE_OFFSET, "corpus cache header outgrew its page");
+
+/* The header a cache made now would have, before any text is counted */
+static void fill_header(CacheHeader& h, const struct stat& st){
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, CACHE_MAGIC, 8);
+  h.version = CACHE_VERSION;
+  h.endian = CACHE_ENDIAN;
+  h.source_size = st.st_size;
+  h.source_time = st.st_mtime;
+  for (int b = 0; b < 256; b++){
+    int i = char_index((char) b);
+    if (i >= 0){
+      h.chars[i] = (char) b;
+      h.vocab = max(h.vocab, (uint32_t) i + 1);
+    }
+  }
+}
+
+/* Read a cache header, false when the file is not a cache */
+static bool read_header(int fd, CacheHeader& h){
+  return pread(fd, &h, sizeof h, 0) == (ssize_t) sizeof h && memcmp(h.magic, CACHE_MAGIC, 8) == 0;
+}
+
+static void write_all(int fd, const void* p, size_t n, off_t at){
+  const char* c = (const char*) p;
+  while (n > 0){
+    ssize_t w = pwrite(fd, c, n, at);
+    if (w <= 0)
+      throw runtime_error("Could not write the corpus cache");
+    c += w;
+    at += w;
+    n -= w;
+  }
+}
+
+Corpus::Corpus(const string& fname): fd(-1), text(NULL), map(NULL), codes(NULL), size(0) {
+  fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("Could not open " + fname);
+  struct stat st;
+  CacheHeader h;
+  if (fstat(fd, &st) != 0){
+    close(fd);
+    throw runtime_error("Could not read " + fname);
+  }
+  if (!read_header(fd, h)){
+    size = st.st_size;
+    for (int b = 0; b < 256; b++)
+      index[b] = char_index((char) b);
+    //streams each read forward through their own slice
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return;
+  }
+
+  //a cache, mapped shared so that every run over it reads the same pages
+  close(fd);
+  fd = -1;
+  CacheHeader now;
+  fill_header(now, st);
+  if (h.version != CACHE_VERSION || h.endian != CACHE_ENDIAN)
+    throw runtime_error(fname + " is from an incompatible version or machine");
+  if (h.vocab != now.vocab || memcmp(h.chars, now.chars, sizeof h.chars) != 0)
+    throw runtime_error(fname + " was cached with a different character encoding");
+  if ((uint64_t) st.st_size != CACHE_OFFSET + h.stats.length)
+    throw runtime_error(fname + " is truncated");
+  map = new Mapping(fname);
+  codes = (const unsigned char*) map->addr + CACHE_OFFSET;
+  size = h.stats.length;
+  cached = h.stats;
+  for (int b = 0; b < 256; b++)
+    index[b] = (b < (int) h.vocab) ? b : -1;
+}
+
+Corpus::Corpus(const string* s): fd(-1), text(s), map(NULL), codes(NULL), size(s->length()) {
+  for (int b = 0; b < 256; b++)
+    index[b] = char_index((char) b);
+}
+
+Corpus::~Corpus(){
+  if (fd >= 0)
+    close(fd);
+  delete map;
+}
+
+void Corpus::encode(size_t p, size_t len, int* out) const {
+  size_t have = (p < size) ? min(len, size - p) : 0;
+  if (codes || text){
+    const unsigned char* b = codes ? codes + p : (const unsigned char*) text->data() + p;
+    for (size_t i = 0; i < have; i++)
+      out[i] = index[b[i]];
+  } else {
+    unsigned char buf[4096];
+    size_t done = 0;
+    while (done < have){
+      ssize_t r = pread(fd, buf, min(sizeof buf, have - done), p + done);
+      if (r <= 0)
+        throw runtime_error("Could not read the corpus");
+      for (ssize_t i = 0; i < r; i++)
+        out[done + i] = index[buf[i]];
+      done += r;
+    }
+  }
+  for (size_t i = have; i < len; i++)
+    out[i] = -1;
+}
+
+void Corpus::release(size_t p, size_t len) const {
+  if (!codes)
+    return;
+  //only whole pages, the ones either side may still be in use
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t from = (CACHE_OFFSET + p + page - 1) / page * page;
+  size_t to = min(CACHE_OFFSET + p + len, map->size) / page * page;
+  if (to > from)
+    madvise((void*) (map->addr + from), to - from, MADV_DONTNEED);
+}
+
+/* Written beside the cache and renamed over it once complete */
+CorpusStats preprocess_corpus(const string& src, const string& dst){
+  int in = open(src.c_str(), O_RDONLY);
+  struct stat st;
+  if (in < 0 || fstat(in, &st) != 0){
+    if (in >= 0)
+      close(in);
+    throw runtime_error("Could not open " + src);
+  }
+  CacheHeader h;
+  fill_header(h, st);
+  int table[256];
+  for (int b = 0; b < 256; b++)
+    table[b] = char_index((char) b);
+
+  string tmp = dst + ".tmp";
+  int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0){
+    close(in);
+    throw runtime_error("Could not create " + tmp);
+  }
+  try {
+    vector<unsigned char> buf(1 << 20);
+    ssize_t r;
+    while ((r = read(in, &buf[0], buf.size())) > 0){
+      for (ssize_t i = 0; i < r; i++){
+        int k = table[buf[i]];
+        if (k < 0){
+          h.stats.unmapped++;
+          buf[i] = CORPUS_NONE;
+        } else {
+          h.stats.counts[k]++;
+          buf[i] = k;
+        }
+      }
+      write_all(out, &buf[0], r, CACHE_OFFSET + h.stats.length);
+      h.stats.length += r;
+    }
+    if (r < 0)
+      throw runtime_error("Could not read " + src);
+    write_all(out, &h, sizeof h, 0);
+    if (ftruncate(out, CACHE_OFFSET + h.stats.length) != 0)
+      throw runtime_error("Could not write the corpus cache");
+  } catch (...){
+    close(in);
+    close(out);
+    unlink(tmp.c_str());
+    throw;
+  }
+  close(in);
+  if (close(out) != 0 || rename(tmp.c_str(), dst.c_str()) != 0){
+    unlink(tmp.c_str());
+    throw runtime_error("Could not write " + dst);
+  }
+  return h.stats;
+}
+
+bool cache_current(const string& cache, const string& src){
+  struct stat st;
+  if (stat(src.c_str(), &st) != 0)
+    return false;
+  int fd = open(cache.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  CacheHeader h;
+  bool ok = read_header(fd, h) && h.version == CACHE_VERSION && h.endian == CACHE_ENDIAN &&
+            h.source_size == (uint64_t) st.st_size && h.source_time == (int64_t) st.st_mtime;
+  close(fd);
+  return ok;
+}
+
+Prefetcher::Prefetcher(const Corpus* c, size_t b, size_t s, int k, size_t f, size_t l):
+                       corpus(c),
+                       base(b),
+                       span(s),
+                       streams(k),
+                       first(f),
+                       last(l),
+                       filled(0),
+                       used(0),
+                       pos(0),
+                       stop(false) {
+  for (int i = 0; i < PREFETCH_DEPTH; i++){
+    ring[i].curr.resize(PREFETCH_STEPS * k);
+    ring[i].next.resize(PREFETCH_STEPS * k);
+    ring[i].steps = 0;
+  }
+  reader = thread(&Prefetcher::run, this);
+}
+
+Prefetcher::~Prefetcher(){
+  {
+    lock_guard<mutex> lock(m);
+    stop = true;
+  }
+  cv.notify_all();
+  reader.join();
+}
+
+/* Hands the worker the chunk in use a step at a time, waiting on the thread only between chunks */
+void Prefetcher::step(const int*& curr, const int*& next){
+  if (pos > 0 && pos == ring[used % PREFETCH_DEPTH].steps){
+    {
+      lock_guard<mutex> lock(m);
+      used++;
+    }
+    cv.notify_all();
+    pos = 0;
+  }
+  if (pos == 0){
+    unique_lock<mutex> lock(m);
+    cv.wait(lock, [&]{ return filled > used || !error.empty(); });
+    if (filled == used)
+      throw runtime_error(error);
+  }
+  Chunk& c = ring[used % PREFETCH_DEPTH];
+  curr = &c.curr[pos * streams];
+  next = &c.next[pos * streams];
+  pos++;
+}
+
+/* Fill each free chunk in turn; the worker only reads chunks already counted as filled */
+void Prefetcher::run(){
+  vector<int> idx(PREFETCH_STEPS + 1);
+  for (size_t start = first; start < last; start += PREFETCH_STEPS){
+    {
+      unique_lock<mutex> lock(m);
+      cv.wait(lock, [&]{ return filled < used + PREFETCH_DEPTH || stop; });
+      if (stop)
+        return;
+    }
+    Chunk& c = ring[filled % PREFETCH_DEPTH];
+    c.steps = min((size_t) PREFETCH_STEPS, last - start);
+    try {
+      for (int k = 0; k < streams; k++){
+        corpus->encode(base + k * span + start, c.steps + 1, &idx[0]);
+        corpus->release(base + k * span + start, c.steps);
+        for (size_t i = 0; i < c.steps; i++){
+          c.curr[i * streams + k] = idx[i];
+          c.next[i * streams + k] = idx[i + 1];
+        }
+      }
+    } catch (runtime_error& e){
+      lock_guard<mutex> lock(m);
+      error = e.what();
+      cv.notify_all();
+      return;
+    }
+    {
+      lock_guard<mutex> lock(m);
+      filled++;
+    }
+    cv.notify_all();
+  }
+}
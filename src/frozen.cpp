@@ -0,0 +1,333 @@
+/*******************************************************************************
+ * Name        : frozen.cpp
+ * Author      : Ben Blease
+ * Date        : 11/10/17
+ * Description : Inference-only copy of a trained network
+ ******************************************************************************/
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include "frozen.h"
+
+using namespace std;
+
+/*
+Quantized file layout, version 1
+  header
+  the embedding, then the gate weights of each layer, then the output weights, each as
+    its scales, rows floats, then its rows of cols bytes
+  the biases of each layer, then the output biases, as floats
+Everything is in the byte order of the writer, tagged in the header
+*/
+#define QUANT_MAGIC "RNNQINT8"
+#define QUANT_VERSION 1
+#define QUANT_ENDIAN 0x01020304u
+
+struct QuantHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian; //QUANT_ENDIAN as the writer stored it
+  uint64_t layers;
+  uint64_t input;
+  uint64_t hidden;
+  uint64_t output;
+};
+
+QMatrix::QMatrix(const real* src, size_t r, size_t c, size_t rs, size_t cs): rows(r), cols(c), stride(c), q(r * c), scale(r) {
+  for (size_t i = 0; i < rows; i++){
+    const real* x = src + i * rs;
+    real top = 0;
+    for (size_t j = 0; j < cols; j++)
+      top = max(top, (real) fabs(x[j * cs]));
+    scale[i] = top / 127;
+    real inv = (top > 0) ? 127 / top : 0;
+    for (size_t j = 0; j < cols; j++)
+      q[i * stride + j] = (int8_t) lrint(x[j * cs] * inv);
+  }
+}
+
+bool quantized_file(const string& fname){
+  ifstream in(fname.c_str(), ios::binary);
+  char magic[8];
+  return in.read(magic, 8) && memcmp(magic, QUANT_MAGIC, 8) == 0;
+}
+
+Frozen::Frozen(const Net& net, Quantize q){
+  freeze(net, q);
+}
+
+Frozen::Frozen(const string& fname, Quantize q){
+  if (quantized_file(fname)){
+    read(fname, q);
+    return;
+  }
+  Net* net = map_net(fname);
+  freeze(*net, q);
+  delete net;
+}
+
+void Frozen::freeze(const Net& net, Quantize q){
+  layers = net.layer_num;
+  m = net.inp_size;
+  n = net.node_num;
+  s = net.output->inp_size;
+  size_t g = 4 * n;
+
+  const Block* first = net.block[0];
+  embed = Matrix<real>(g, m);
+  for (size_t c = 0; c < m; c++)
+    for (size_t r = 0; r < g; r++)
+      embed[c][r] = first->w[r][c];
+
+  weights.clear();
+  bias.clear();
+  for (size_t l = 0; l < layers; l++){
+    const Block* blk = net.block[l];
+    size_t in = (l == 0) ? 0 : n;
+    Matrix<real> wu(in + n, g);
+    for (size_t r = 0; r < g; r++){
+      if (in)
+        copy(blk->w[r], blk->w[r] + in, wu[r]);
+      copy(blk->u[r], blk->u[r] + n, wu[r] + in);
+    }
+    weights.push_back(wu);
+    bias.push_back(blk->b);
+  }
+  out_w = net.output->w;
+  out_b = net.output->b;
+
+  //only the int8 copies are kept
+  quant = q;
+  qweights.clear();
+  if (quant){
+    qembed = QMatrix(embed.data(), m, g, embed.stride(), 1);
+    for (size_t l = 0; l < layers; l++)
+      qweights.push_back(QMatrix(weights[l].data(), g, weights[l].cols(), weights[l].stride(), 1));
+    qout = QMatrix(out_w.data(), s, n, 1, out_w.stride());
+    //the file keeps the biases as floats, so they are rounded here too and a loaded copy predicts the same
+    for (size_t l = 0; l < layers; l++)
+      for (real& b : bias[l])
+        b = (float) b;
+    for (real& b : out_b)
+      b = (float) b;
+    embed = Matrix<real>();
+    weights.clear();
+    out_w = Matrix<real>();
+  }
+  prepare();
+}
+
+/* Read whole, every size checked against the header before it is trusted */
+void Frozen::read(const string& fname, Quantize q){
+  ifstream in(fname.c_str(), ios::binary);
+  QuantHeader hd;
+  if (!in.read((char*) &hd, sizeof hd) || memcmp(hd.magic, QUANT_MAGIC, 8) != 0)
+    throw runtime_error(fname + " is not a quantized network");
+  if (hd.endian != QUANT_ENDIAN)
+    throw runtime_error(fname + " was saved on a machine of the other byte order");
+  if (hd.version > QUANT_VERSION)
+    throw runtime_error(fname + " was saved by a newer version");
+  layers = hd.layers;
+  m = hd.input;
+  n = hd.hidden;
+  s = hd.output;
+  if (layers == 0 || n == 0 || m == 0 || s == 0)
+    throw runtime_error(fname + " has an empty network");
+
+  //the sizes the header implies must add up to the file's length before anything is allocated,
+  //each product checked against what is left so a forged header cannot wrap the sum
+  in.seekg(0, ios::end);
+  uint64_t length = in.tellg();
+  in.seekg(sizeof hd);
+  uint64_t expect = sizeof hd;
+  bool fits = in && n <= length / 8 && layers <= length;
+  auto need = [&](uint64_t rows, uint64_t cols){
+    if (fits && rows <= (length - expect) / cols)
+      expect += rows * cols;
+    else
+      fits = false;
+  };
+  size_t g = 4 * n;
+  need(m, sizeof (float) + g);
+  for (size_t l = 0; fits && l < layers; l++)
+    need(g, sizeof (float) + ((l == 0) ? n : 2 * n));
+  need(s, sizeof (float) + n);
+  for (size_t l = 0; fits && l < layers; l++)
+    need(g, sizeof (float));
+  need(s, sizeof (float));
+  if (!fits || expect != length)
+    throw runtime_error("Size of " + fname + " does not match its header");
+
+  auto matrix = [&](QMatrix& a, size_t rows, size_t cols){
+    a.rows = rows;
+    a.cols = a.stride = cols;
+    a.scale.resize(rows);
+    a.q.resize(rows * cols);
+    in.read((char*) a.scale.data(), rows * sizeof (float));
+    in.read((char*) a.q.data(), rows * cols);
+  };
+  auto floats = [&](vector<real>& v, size_t len){
+    vector<float> f(len);
+    in.read((char*) f.data(), len * sizeof (float));
+    v.assign(f.begin(), f.end());
+  };
+  matrix(qembed, m, g);
+  qweights.resize(layers);
+  for (size_t l = 0; l < layers; l++)
+    matrix(qweights[l], g, (l == 0) ? n : 2 * n);
+  matrix(qout, s, n);
+  bias.resize(layers);
+  for (size_t l = 0; l < layers; l++)
+    floats(bias[l], g);
+  floats(out_b, s);
+  if (!in)
+    throw runtime_error("Truncated quantized file " + fname);
+
+  quant = (q == QUANT_ALL) ? QUANT_ALL : QUANT_WEIGHTS;
+  embed = Matrix<real>();
+  weights.clear();
+  out_w = Matrix<real>();
+  prepare();
+}
+
+/* Written beside the file and renamed over it once complete */
+void Frozen::write(const string& fname) const {
+  if (!quant)
+    throw runtime_error("Only a quantized network can be written");
+  QuantHeader hd;
+  memset(&hd, 0, sizeof hd);
+  memcpy(hd.magic, QUANT_MAGIC, 8);
+  hd.version = QUANT_VERSION;
+  hd.endian = QUANT_ENDIAN;
+  hd.layers = layers;
+  hd.input = m;
+  hd.hidden = n;
+  hd.output = s;
+
+  string tmp = fname + ".tmp";
+  ofstream out(tmp.c_str(), ios::binary | ios::trunc);
+  out.write((const char*) &hd, sizeof hd);
+  auto matrix = [&](const QMatrix& a){
+    out.write((const char*) a.scale.data(), a.rows * sizeof (float));
+    for (size_t r = 0; r < a.rows; r++)
+      out.write((const char*) a.row(r), a.cols);
+  };
+  auto floats = [&](const vector<real>& v){
+    vector<float> f(v.begin(), v.end());
+    out.write((const char*) f.data(), f.size() * sizeof (float));
+  };
+  matrix(qembed);
+  for (size_t l = 0; l < layers; l++)
+    matrix(qweights[l]);
+  matrix(qout);
+  for (size_t l = 0; l < layers; l++)
+    floats(bias[l]);
+  floats(out_b);
+  out.close();
+  if (!out || rename(tmp.c_str(), fname.c_str()) != 0){
+    remove(tmp.c_str());
+    throw runtime_error("Could not write " + fname);
+  }
+}
+
+size_t Frozen::weight_bytes() const {
+  size_t bytes = 0;
+  if (quant){
+    bytes += qembed.q.size() + qembed.scale.size() * sizeof (float);
+    for (size_t l = 0; l < layers; l++)
+      bytes += qweights[l].q.size() + qweights[l].scale.size() * sizeof (float);
+    bytes += qout.q.size() + qout.scale.size() * sizeof (float);
+  } else {
+    bytes += (size_t) embed.rows() * embed.cols() * sizeof (real);
+    for (size_t l = 0; l < layers; l++)
+      bytes += (size_t) weights[l].rows() * weights[l].cols() * sizeof (real);
+    bytes += (size_t) out_w.rows() * out_w.cols() * sizeof (real);
+  }
+  for (size_t l = 0; l < layers; l++)
+    bytes += bias[l].size() * sizeof (real);
+  return bytes + out_b.size() * sizeof (real);
+}
+
+void Frozen::prepare(){
+  size_t g = 4 * n;
+  k = &kernels<real>();
+  qgemv = (quant == QUANT_ALL && k->gemv_q8x8) ? k->gemv_q8x8 : k->gemv_q8;
+
+  h.assign(layers * n, 0.0);
+  state.assign(layers * n, 0.0);
+  pre.assign(g, 0.0);
+  act.assign(g, 0.0);
+  o.assign(s, 0.0);
+  logits.assign(quant ? s : 0, 0.0);
+  sampler.seed(random_device()());
+  sampler.reserve(s);
+  reset();
+}
+
+void Frozen::reset(){
+  fill(h.begin(), h.end(), 0.0);
+  fill(state.begin(), state.end(), 0.0);
+  fill(o.begin(), o.end(), 1.0 / s);
+}
+
+void Frozen::feed(char c){
+  size_t g = 4 * n;
+  int index = char_index(c);
+  for (size_t l = 0; l < layers; l++){
+    real* hl = &h[l * n];
+    if (quant){
+      const QMatrix& wu = qweights[l];
+      if (l == 0){
+        if (index >= 0 && (size_t) index < m){
+          const int8_t* e = qembed.row(index);
+          real sc = qembed.scale[index];
+          for (size_t r = 0; r < g; r++)
+            pre[r] = e[r] * sc;
+        } else {
+          fill(pre.begin(), pre.end(), 0.0);
+        }
+        qgemv(wu.row(0), g, n, wu.stride, wu.scale.data(), hl, pre.data(), true);
+      } else {
+        qgemv(wu.row(0), g, 2 * n, wu.stride, wu.scale.data(), hl - n, pre.data(), false);
+      }
+    } else {
+      const Matrix<real>& wu = weights[l];
+      if (l == 0){
+        if (index >= 0 && (size_t) index < m)
+          copy(embed[index], embed[index] + g, pre.begin());
+        else
+          fill(pre.begin(), pre.end(), 0.0);
+        k->gemv(wu.data(), g, n, wu.stride(), hl, pre.data(), true);
+      } else {
+        k->gemv(wu.data(), g, 2 * n, wu.stride(), hl - n, pre.data(), false);
+      }
+    }
+    k->lstm_cell(pre.data(), bias[l].data(), &state[l * n], act.data(), &state[l * n], hl, n);
+  }
+  real ly;
+  if (quant){
+    //the logits come whole from the int8 product, the output kernel then only takes their softmax
+    copy(out_b.begin(), out_b.end(), logits.begin());
+    qgemv(qout.row(0), s, n, qout.stride, qout.scale.data(), &h[(layers - 1) * n], logits.data(), true);
+    k->output(NULL, 0, s, 0, logits.data(), NULL, o.data(), -1, NULL, &ly);
+  } else {
+    k->output(out_w.data(), n, s, out_w.stride(), out_b.data(), &h[(layers - 1) * n], o.data(), -1, NULL, &ly);
+  }
+}
+
+char Frozen::sample(){
+  return sampler.pick(o.data(), s);
+}
+
+void Frozen::generate(const char* prompt, size_t len, char* out, size_t count){
+  reset();
+  for (size_t i = 0; i < len; i++)
+    feed(prompt[i]);
+  for (size_t i = 0; i < count; i++){
+    out[i] = sample();
+    feed(out[i]);
+  }
+}
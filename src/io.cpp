@@ -6,14 +6,14 @@
  ******************************************************************************/
 
 #include "core.h"
+#include "sampler.h"
 #include <random>
-#include <algorithm>
 
 using namespace std;
 
 /* Turn a relevant ASCII character into a one-hot vector */
-vector<double> vectorize(char c){
-  vector<double> out;
+vector<real> vectorize(char c){
+  vector<real> out;
   for (int i = 32; i < 127; i++){
   	if (i == c)
   		out.push_back(1.0);
@@ -23,18 +23,21 @@ vector<double> vectorize(char c){
   return out;
 }
 
-/* Do a weighted random pick from probabilities */
-char pick_char(const vector<double>& v){
-  discrete_distribution<int> d = discrete_distribution<int>(begin(v), end(v));
-  random_device r;
-  mt19937 gen(r());
-  int out = d(gen);
-  return (char) (out + 32);
+/* Position of a character in the one-hot vector, -1 if it has none */
+int char_index(char c){
+  if (c < 32 || c >= 127)
+    return -1;
+  return c - 32;
 }
 
-char max_pick_char(const vector<double>& v){
-	int index = distance(v.begin(), max_element(v.begin(), v.end()));
-	return (char) (index + 32);
+/* Do a weighted random pick from probabilities, from one sampler seeded at random for the process */
+char pick_char(const vector<real>& v){
+  static Sampler sampler((random_device())());
+  return sampler.pick(v.data(), v.size());
+}
+
+char max_pick_char(const vector<real>& v){
+	return (char) (Sampler::greedy(v.data(), v.size()) + 32);
 }
 
 
@@ -5,9 +5,15 @@
  * Description : Run LSTM with user input
  ******************************************************************************/
 
-#include <fstream>
+#include <algorithm>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "core.h"
+#include "corpus.h"
+#include "server.h"
+#include "beam.h"
+#include "frozen.h"
 
 using namespace std;
 
@@ -23,52 +29,189 @@ memory blocks consist of 64 cells (a relatively simple network) for quick traini
 #define DEFAULT_INPUT_SIZE 95
 #define DEFAULT_BLOCK_SIZE 10
 #define DEFAULT_OUTPUT_SIZE 50
+#define DEFAULT_SESSIONS 64 //sessions a server advances together
+#define DEFAULT_PREFIX_MB 64 //megabytes of prompt prefix state a server caches, 0 for none
+#define DEFAULT_BEAM_WIDTH 8 //beams a beam search keeps
 #define DEFAULT_READ_SIZE -1 //read the whole file
 #define DEFAULT_LIMIT 40000
 #define DEFAULT_LEARN 0.1
 #define DEFAULT_LAMBDA 0.01
+#define DEFAULT_STREAMS 1 //streams per thread, advanced in lockstep
+#define DEFAULT_THREADS 1 //training workers, each with a shard of the input
+#define DEFAULT_COMBINE SYNC //SYNC or HOGWILD gradient sharing between workers
+#define DEFAULT_CHECKPOINT 0 //steps between BPTT checkpoints, 0 keeps every step
+#define DEFAULT_BPTT_BUDGET 0 //bytes of BPTT history per worker, checkpointing as needed to fit; 0 for no limit
+#define DEFAULT_SAVE_SECONDS 60 //seconds between background saves while training, 0 for none
 
 //paths and names
 #define DEFAULT_Y_PATH "./output/"
 #define DEFAULT_Y_NAME "y.txt"
 #define DEFAULT_X_PATH "./input/"
 #define DEFAULT_X_NAME "x2.txt"
+#define DEFAULT_CACHE_NAME "x2.idx" //made by ./RNN preprocess, used instead of the text while current
 #define DEFAULT_SAVE_PATH "./saves/"
 #define SAVE_NAME(l, s, b, n) "net"#l"_"#s"_"#b"_"#n".bin"
+#define DEFAULT_SAVE_NAME "net.rnn"
 
 //behavior
 #define SAVE_TRAINING true
+#define RESUME_TRAINING true //continue an unfinished run from its last save
 #define RUN_TRAINED true
 #define DEBUG false
 
 /*
-Read a large input file for use with the network
+Load a save left by a training run that stopped part way through, NULL if there is none
 */
-string* read_input(string fname, string* in_pointer){
-  ifstream infile;
-  infile.open(fname);
-  string ln;
-  while(getline(infile, ln)){
-    (*in_pointer) += "\n" + ln;
+Net* resume_net(string fname, const Corpus* text){
+  struct stat st;
+  if (stat(fname.c_str(), &st) != 0)
+    return NULL;
+  Net* net = NULL;
+  try{
+    net = read_net(fname);
+  } catch(runtime_error& e){
+    cerr << e.what() << endl;
+    return NULL;
   }
-  return in_pointer;
+  const TrainCursor& c = net->cursor;
+  if (c.limit == 0 || c.step >= min(text->length(), c.limit) / (c.streams * c.threads)){
+    delete net;
+    return NULL;
+  }
+  return net;
+}
+
+/*
+Encode a text file into a cache for training, ./RNN preprocess [text] [cache]
+*/
+int preprocess(int argc, char** argv){
+  string src = (argc > 2) ? argv[2] : DEFAULT_X_PATH DEFAULT_X_NAME;
+  string dst = (argc > 3) ? argv[3] : DEFAULT_X_PATH DEFAULT_CACHE_NAME;
+  try{
+    CorpusStats st = preprocess_corpus(src, dst);
+    int used = 0;
+    for (int i = 0; i < 256; i++)
+      used += st.counts[i] ? 1 : 0;
+    cout << "Cached " << st.length << " characters of " << src << " in " << dst << ", " << used 
+         << " distinct, " << st.unmapped << " without an index" << endl;
+  } catch(runtime_error& e){
+    cerr << e.what() << endl;
+    return 1;
+  }
+  return 0;
 }
 
 int main(int argc, char** argv){
+  if (argc > 1 && string(argv[1]) == "preprocess")
+    return preprocess(argc, argv);
+
+  //serve a saved network over stdin and stdout, ./RNN serve <model> [sessions] [prefix cache MB]
+  if (argc > 2 && string(argv[1]) == "serve"){
+    try{
+      Net* rnn = map_net(argv[2]);
+      size_t cache = (argc > 4) ? atol(argv[4]) : DEFAULT_PREFIX_MB;
+      serve(rnn, (argc > 3) ? atoi(argv[3]) : DEFAULT_SESSIONS, cache << 20, cin, cout);
+      delete rnn;
+    } catch(runtime_error& e){
+      cerr << e.what() << endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  //beam search a saved network, ./RNN beam <model> [width] [seed]
+  if (argc > 2 && string(argv[1]) == "beam"){
+    try{
+      Net* rnn = map_net(argv[2]);
+      string seed = (argc > 4) ? argv[4] : "a";
+      vector<Beam> beams = beam_search(rnn, seed, DEFAULT_OUTPUT_SIZE, (argc > 3) ? atoi(argv[3]) : DEFAULT_BEAM_WIDTH);
+      for (const Beam& b : beams)
+        cout << b.score << "\t" << seed << b.text << endl;
+      delete rnn;
+    } catch(runtime_error& e){
+      cerr << e.what() << endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  //round a saved network's weights to int8 for inference, ./RNN quantize <model> <out>
+  if (argc > 3 && string(argv[1]) == "quantize"){
+    try{
+      Frozen frozen(argv[2], QUANT_WEIGHTS);
+      frozen.write(argv[3]);
+      cout << "Wrote " << argv[3] << ", " << frozen.weight_bytes() << " bytes of weights" << endl;
+    } catch(runtime_error& e){
+      cerr << e.what() << endl;
+      return 1;
+    }
+    return 0;
+  }
+
   //use fallback values
-  string in;
   if (argc == 1){
-    read_input(DEFAULT_X_PATH DEFAULT_X_NAME, &in);
-    Net* rnn = new Net(&in, DEFAULT_LAYER_SIZE, DEFAULT_INPUT_SIZE, DEFAULT_HIDDEN_SIZE, DEFAULT_BLOCK_SIZE);
+    //mapped from the cache when it is current, otherwise read from the text as training goes
+    Corpus* text = NULL;
+    try{
+      if (cache_current(DEFAULT_X_PATH DEFAULT_CACHE_NAME, DEFAULT_X_PATH DEFAULT_X_NAME)){
+        text = new Corpus(DEFAULT_X_PATH DEFAULT_CACHE_NAME);
+        if (text->stats()->unmapped)
+          cerr << text->stats()->unmapped << " characters have no index and are skipped" << endl;
+      } else {
+        text = new Corpus(DEFAULT_X_PATH DEFAULT_X_NAME);
+      }
+    } catch(runtime_error& e){
+      cerr << e.what() << endl;
+      return 1;
+    }
+    Net* rnn = RESUME_TRAINING ? resume_net(DEFAULT_SAVE_PATH DEFAULT_SAVE_NAME, text) : NULL;
+    if (!rnn)
+      rnn = new Net(new string(), DEFAULT_LAYER_SIZE, DEFAULT_INPUT_SIZE, DEFAULT_HIDDEN_SIZE, DEFAULT_BLOCK_SIZE);
+    rnn->corpus = text;
 
-    //write_net(rnn, DEFAULT_SAVE_PATH SAVE_NAME(3, 95, 100, 64));
     try{
-      rnn->train(DEFAULT_LEARN, DEFAULT_LAMBDA, DEFAULT_LIMIT);
+      //saves in the background as it goes, and once more when done
+      if (SAVE_TRAINING){
+        mkdir(DEFAULT_SAVE_PATH, 0755);
+        rnn->save_path = DEFAULT_SAVE_PATH DEFAULT_SAVE_NAME;
+        rnn->save_seconds = DEFAULT_SAVE_SECONDS;
+      }
+      rnn->checkpoint = DEFAULT_CHECKPOINT;
+      if (DEFAULT_BPTT_BUDGET)
+        rnn->checkpoint = rnn->plan_checkpoint(DEFAULT_BPTT_BUDGET, DEFAULT_STREAMS);
+      rnn->train(DEFAULT_LEARN, DEFAULT_LAMBDA, DEFAULT_LIMIT, DEFAULT_STREAMS, DEFAULT_THREADS, DEFAULT_COMBINE);
     } catch(runtime_error& e){
       cerr << e.what() << endl;
       cerr << "This is usually caused by misrepresenting the dimensionality of your data" << endl;
     }
     cout << endl;
     rnn->run(50, "a");
-  }    
+  } else {
+    //run a saved network, mapped so that concurrent runs share its weights; one written by
+    //./RNN quantize has no Net and runs straight from its Frozen
+    try{
+      SampleParams params;
+      if (argc > 3)
+        params.temperature = atof(argv[3]);
+      if (argc > 4)
+        params.top_k = atol(argv[4]);
+      if (argc > 5)
+        params.top_p = atof(argv[5]);
+      string seed = (argc > 2) ? argv[2] : "a";
+      if (quantized_file(argv[1])){
+        Frozen frozen(argv[1], QUANT_ALL);
+        frozen.sampler.params = params;
+        string out = seed + string(DEFAULT_OUTPUT_SIZE, ' ');
+        frozen.generate(seed.data(), seed.length(), &out[seed.length()], DEFAULT_OUTPUT_SIZE);
+        cout << out << endl;
+        return 0;
+      }
+      Net* rnn = map_net(argv[1]);
+      rnn->run(DEFAULT_OUTPUT_SIZE, seed, params);
+      delete rnn;
+    } catch(runtime_error& e){
+      cerr << e.what() << endl;
+      return 1;
+    }
+  }
 }
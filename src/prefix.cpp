@@ -0,0 +1,168 @@
+/*******************************************************************************
+ * Name        : prefix.cpp
+ * Author      : Ben Blease
+ * Date        : 11/8/17
+ * Description : Cache of the recurrent state after common prompt prefixes
+ ******************************************************************************/
+
+#include "prefix.h"
+
+using namespace std;
+
+//rough cost of a trie node beyond its snapshot and edge, the node and its entry in the parent's map
+#define NODE_BYTES (sizeof (Node) + 48)
+
+PrefixCache::PrefixCache(size_t l, size_t h, size_t c): layers(l), n(h), cap(c) {
+  root.parent = NULL;
+}
+
+PrefixCache::~PrefixCache(){
+  //depth first without recursion, prompts can be long
+  vector<Node*> open;
+  for (auto& child : root.children)
+    open.push_back(child.second);
+  while (!open.empty()){
+    Node* node = open.back();
+    open.pop_back();
+    for (auto& child : node->children)
+      open.push_back(child.second);
+    delete node;
+  }
+}
+
+/* Only prefixes that leave a character of the prompt to feed count */
+size_t PrefixCache::restore(const string& prompt, Context& ctx, int row, size_t& shared){
+  stats.lookups++;
+  Node* node = &root;
+  Node* best = NULL;
+  size_t len = 0;
+  size_t i = 0;
+  size_t end = prompt.empty() ? 0 : prompt.length() - 1;
+  while (i < end){
+    map<char, Node*>::iterator next = node->children.find(prompt[i]);
+    if (next == node->children.end())
+      break;
+    const string& edge = next->second->edge;
+    size_t j = 0;
+    while (j < edge.length() && i + j < end && edge[j] == prompt[i + j])
+      j++;
+    i += j;
+    if (j < edge.length())
+      break;
+    node = next->second;
+    if (!node->snap.empty()){
+      best = node;
+      len = i;
+    }
+  }
+  shared = i;
+
+  for (size_t l = 0; l < layers; l++){
+    real* h = ctx.h[l].data() + row * n;
+    real* state = ctx.state[l].data() + row * n;
+    if (best){
+      copy(best->snap.begin() + 2 * l * n, best->snap.begin() + (2 * l + 1) * n, h);
+      copy(best->snap.begin() + (2 * l + 1) * n, best->snap.begin() + (2 * l + 2) * n, state);
+    } else {
+      fill(h, h + n, 0.0);
+      fill(state, state + n, 0.0);
+    }
+  }
+  if (best){
+    stats.hits++;
+    stats.skipped += len;
+    lru.splice(lru.begin(), lru, best->age);
+  }
+  return len;
+}
+
+/* Walks down the prefix, splitting the edge it leaves part way along */
+void PrefixCache::store(const string& prompt, size_t len, const Context& ctx, int row){
+  Node* node = &root;
+  size_t i = 0;
+  while (i < len){
+    Node*& slot = node->children[prompt[i]];
+    if (!slot){
+      slot = new Node();
+      slot->parent = node;
+      slot->edge = prompt.substr(i, len - i);
+      stats.bytes += NODE_BYTES + slot->edge.length();
+      node = slot;
+      break;
+    }
+    Node* child = slot;
+    size_t common = 0;
+    while (common < child->edge.length() && i + common < len && child->edge[common] == prompt[i + common])
+      common++;
+    if (common < child->edge.length()){
+      Node* mid = new Node();
+      mid->parent = node;
+      mid->edge = child->edge.substr(0, common);
+      child->edge.erase(0, common);
+      child->parent = mid;
+      mid->children[child->edge[0]] = child;
+      slot = mid;
+      stats.bytes += NODE_BYTES;
+      child = mid;
+    }
+    node = child;
+    i += common;
+  }
+  if (!node->snap.empty()){
+    lru.splice(lru.begin(), lru, node->age);
+    return;
+  }
+
+  node->snap.resize(2 * layers * n);
+  for (size_t l = 0; l < layers; l++){
+    const real* h = ctx.h[l].data() + row * n;
+    const real* state = ctx.state[l].data() + row * n;
+    copy(h, h + n, node->snap.begin() + 2 * l * n);
+    copy(state, state + n, node->snap.begin() + (2 * l + 1) * n);
+  }
+  lru.push_front(node);
+  node->age = lru.begin();
+  stats.stored++;
+  stats.entries++;
+  stats.bytes += node->snap.size() * sizeof (real);
+  evict();
+}
+
+/* Drop the oldest snapshots until under the cap */
+void PrefixCache::evict(){
+  while (stats.bytes > cap && !lru.empty()){
+    Node* node = lru.back();
+    lru.pop_back();
+    stats.bytes -= node->snap.size() * sizeof (real);
+    vector<real>().swap(node->snap);
+    stats.entries--;
+    stats.evicted++;
+    remove(node);
+  }
+}
+
+/*
+Tidy the trie above a node that lost its snapshot: nodes leading nowhere go, and a node
+left with a single child and no snapshot is merged into that child
+*/
+void PrefixCache::remove(Node* node){
+  while (node != &root && node->snap.empty()){
+    Node* parent = node->parent;
+    if (node->children.empty()){
+      parent->children.erase(node->edge[0]);
+      stats.bytes -= NODE_BYTES + node->edge.length();
+      delete node;
+      node = parent;
+      continue;
+    }
+    if (node->children.size() == 1){
+      Node* child = node->children.begin()->second;
+      child->edge = node->edge + child->edge;
+      child->parent = parent;
+      parent->children[child->edge[0]] = child;
+      stats.bytes -= NODE_BYTES;
+      delete node;
+    }
+    break;
+  }
+}
@@ -2,38 +2,391 @@
  * Name        : rw.cpp
  * Author      : Ben Blease
  * Date        : 10/11/17
- * Description : Read/Write save files (WIP)
+ * Description : Read/Write save files
  ******************************************************************************/
 
 #include "core.h"
 #include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 /*
-Write the network information to a binary file
+Save file layout, version 1
+	header
+	section table, one entry per weight array
+	sections, each starting on a MATRIX_ALIGN boundary
+Weights are stored exactly as a Matrix holds them, gates stacked z i f o and rows
+padded out to the Matrix stride, so a mapped file can be used in place
+Everything is in the byte order and precision of the writer, both tagged in the header
+The checksum covers the whole file, taken with its own field zeroed
+Readers skip sections of kinds they do not know, so new kinds keep the version
 */
-void write_net(Net* net, string fname){
-	ofstream file;
-	file.open(fname, ios::out | ios::binary);
+#define MODEL_MAGIC "RNNMODEL"
+#define MODEL_VERSION 1
+#define MODEL_ENDIAN 0x01020304u
+
+struct FileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian; //MODEL_ENDIAN as the writer stored it
+	uint32_t precision; //bytes per weight
+	uint32_t sections;
+	uint64_t layers;
+	uint64_t input;
+	uint64_t hidden;
+	int64_t block;
+	uint64_t size; //of the whole file
+	uint64_t checksum;
+};
+
+enum SectionKind {
+	SEC_BLOCK_W = 1,
+	SEC_BLOCK_U,
+	SEC_BLOCK_B,
+	SEC_OUTPUT_W,
+	SEC_OUTPUT_B,
+	SEC_CURSOR //training progress, one FileCursor
+};
+
+struct FileSection {
+	uint32_t kind;
+	uint32_t layer;
+	uint64_t offset; //from the start of the file
+	uint64_t rows;
+	uint64_t cols;
+	uint64_t stride; //elements between the starts of rows
+};
+
+struct FileCursor {
+	uint64_t step;
+	uint64_t chars;
+	uint64_t limit;
+	double rate;
+	double lambda;
+	int32_t streams;
+	int32_t threads;
+};
+
+/* Bytes in a section, the cursor being raw bytes and the rest weights of the given size */
+static uint64_t section_bytes(const FileSection& s, size_t precision){
+	return s.rows * s.stride * ((s.kind == SEC_CURSOR) ? 1 : precision);
+}
+
+static uint64_t align(uint64_t n){
+	return (n + MATRIX_ALIGN - 1) / MATRIX_ALIGN * MATRIX_ALIGN;
+}
+
+/* FNV-1a over 64 bit words, continuing from h; n is a multiple of 8 */
+static uint64_t checksum(const char* p, size_t n, uint64_t h = 14695981039346656037ull){
+	for (size_t i = 0; i < n; i += 8){
+		uint64_t w;
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * 1099511628211ull;
+	}
+	return h;
+}
+
+Mapping::Mapping(const string& fname): addr(NULL), size(0) {
+	int fd = open(fname.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw runtime_error("Could not open " + fname);
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0){
+		close(fd);
+		throw runtime_error("Could not read " + fname);
+	}
+	size = st.st_size;
+	void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		throw runtime_error("Could not map " + fname);
+	addr = (const char*) p;
+}
 
-	size_t l = net->layer_num;
-	size_t s = net->inp_size;
-	size_t n = net->node_num;
-	int b = net->block_size;
+Mapping::~Mapping(){
+	munmap((void*) addr, size);
+}
+
+/*
+Lay out the save file of a network in buf, copying the weights in
+buf keeps its storage between calls, so once sized this only copies
+*/
+void net_image(Net* net, vector<char>& buf){
+	vector<FileSection> table;
+	vector<const void*> src;
+	for (size_t l = 0; l < net->block.size(); l++){
+		Block* blk = net->block[l];
+		FileSection w = {SEC_BLOCK_W, (uint32_t) l, 0, (uint64_t) blk->w.rows(), (uint64_t) blk->w.cols(), (uint64_t) blk->w.stride()};
+		FileSection u = {SEC_BLOCK_U, (uint32_t) l, 0, (uint64_t) blk->u.rows(), (uint64_t) blk->u.cols(), (uint64_t) blk->u.stride()};
+		FileSection b = {SEC_BLOCK_B, (uint32_t) l, 0, 1, blk->b.size(), blk->b.size()};
+		table.push_back(w);
+		src.push_back(blk->w.data());
+		table.push_back(u);
+		src.push_back(blk->u.data());
+		table.push_back(b);
+		src.push_back(blk->b.data());
+	}
+	Output* out = net->output;
+	FileSection w = {SEC_OUTPUT_W, 0, 0, (uint64_t) out->w.rows(), (uint64_t) out->w.cols(), (uint64_t) out->w.stride()};
+	FileSection b = {SEC_OUTPUT_B, 0, 0, 1, out->b.size(), out->b.size()};
+	table.push_back(w);
+	src.push_back(out->w.data());
+	table.push_back(b);
+	src.push_back(out->b.data());
 
-	//write the basic information
-	//first four positions are non-weight information
-	file.seekp(0);
-	file.write((char*) &l, sizeof (size_t));
-	file.write((char*) &s, sizeof (size_t));
-	file.write((char*) &n, sizeof (size_t));
-	file.write((char*) &b, sizeof (int));
+	//training progress, stored as one row of bytes
+	const TrainCursor& c = net->cursor;
+	FileCursor cursor = {c.step, c.chars, c.limit, c.rate, c.lambda, c.streams, c.threads};
+	FileSection cs = {SEC_CURSOR, 0, 0, 1, sizeof cursor, sizeof cursor};
+	table.push_back(cs);
+	src.push_back(&cursor);
+	size_t sections = table.size();
+
+	//lay out the sections after the table
+	uint64_t size = align(sizeof (FileHeader) + sections * sizeof (FileSection));
+	for (size_t i = 0; i < sections; i++){
+		table[i].offset = size;
+		size = align(size + section_bytes(table[i], sizeof (real)));
+	}
+
+	buf.resize(size);
+	FileHeader h;
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, MODEL_MAGIC, 8);
+	h.version = MODEL_VERSION;
+	h.endian = MODEL_ENDIAN;
+	h.precision = sizeof (real);
+	h.sections = sections;
+	h.layers = net->layer_num;
+	h.input = net->inp_size;
+	h.hidden = net->node_num;
+	h.block = net->block_size;
+	h.size = size;
+	memcpy(&buf[0], &h, sizeof h);
+	memcpy(&buf[sizeof h], table.data(), sections * sizeof (FileSection));
+	//zero the gaps too, the buffer may hold an older image
+	uint64_t end = sizeof h + sections * sizeof (FileSection);
+	for (size_t i = 0; i < sections; i++){
+		size_t len = section_bytes(table[i], sizeof (real));
+		memset(&buf[end], 0, table[i].offset - end);
+		memcpy(&buf[table[i].offset], src[i], len);
+		end = table[i].offset + len;
+	}
+	memset(&buf[end], 0, size - end);
 }
 
+/*
+Checksum an image from net_image and write it
+The file is written beside its destination and renamed over it, so a reader
+(or a process that has it mapped) never sees a partial file; durable forces it
+to disk before the rename
+*/
+void write_image(vector<char>& buf, string fname, bool durable){
+	FileHeader* h = (FileHeader*) &buf[0];
+	h->checksum = 0;
+	h->checksum = checksum(&buf[0], buf.size());
+
+	string tmp = fname + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool ok = fd >= 0;
+	for (size_t done = 0; ok && done < buf.size(); ){
+		ssize_t n = write(fd, &buf[done], buf.size() - done);
+		ok = n > 0;
+		done += ok ? n : 0;
+	}
+	if (ok && durable)
+		ok = fsync(fd) == 0;
+	if (fd >= 0)
+		ok = (close(fd) == 0) && ok;
+	if (!ok || rename(tmp.c_str(), fname.c_str()) != 0){
+		remove(tmp.c_str());
+		throw runtime_error("Could not write " + fname);
+	}
+}
+
+/* Write the network to a binary file */
+void write_net(Net* net, string fname){
+	vector<char> buf;
+	net_image(net, buf);
+	write_image(buf, fname, false);
+}
 
-Net* read_file(string fname){
-	ifstream file (fname, ios::in | ios::binary);
+/* Section of a kind and layer, NULL when the file has none */
+static const FileSection* lookup(const Mapping& m, uint32_t kind, uint32_t layer){
+	const FileHeader* h = (const FileHeader*) m.addr;
+	const FileSection* table = (const FileSection*) (m.addr + sizeof (FileHeader));
+	for (uint32_t i = 0; i < h->sections; i++)
+		if (table[i].kind == kind && table[i].layer == layer)
+			return &table[i];
 	return NULL;
 }
 
+/* 
+Section of a kind and layer, checked against the shape it must have
+It must lie within the file and start on a MATRIX_ALIGN boundary, so it can be borrowed in place
+*/
+static const FileSection& find_section(const Mapping& m, uint32_t kind, uint32_t layer, size_t rows, size_t cols){
+	const FileSection* s = lookup(m, kind, layer);
+	if (!s)
+		throw runtime_error("Save file is missing a section");
+	uint64_t unit = (s->kind == SEC_CURSOR) ? 1 : ((const FileHeader*) m.addr)->precision;
+	if (s->rows != rows || s->cols != cols || s->stride < cols || s->stride > m.size ||
+		s->offset % MATRIX_ALIGN != 0 || s->offset > m.size ||
+		s->rows > (m.size - s->offset) / (s->stride * unit))
+		throw runtime_error("Malformed section in save file");
+	return *s;
+}
+
+/* Validate a whole file image, returning its header */
+static const FileHeader* check_file(const Mapping& m, const string& fname, bool verify){
+	const FileHeader* h = (const FileHeader*) m.addr;
+	if (m.size < sizeof (FileHeader) || memcmp(h->magic, MODEL_MAGIC, 8) != 0)
+		throw runtime_error(fname + " is not a saved network");
+	if (h->endian != MODEL_ENDIAN)
+		throw runtime_error(fname + " was saved on a machine of the other byte order");
+	if (h->version > MODEL_VERSION)
+		throw runtime_error(fname + " was saved by a newer version");
+	if (h->precision != sizeof (float) && h->precision != sizeof (double))
+		throw runtime_error(fname + " has an unknown precision");
+	if (h->size != m.size || sizeof (FileHeader) + (uint64_t) h->sections * sizeof (FileSection) > m.size)
+		throw runtime_error("Truncated save file " + fname);
+	//the writer pads to a whole number of words, which the checksum reads
+	if (m.size % 8 != 0)
+		throw runtime_error("Malformed save file " + fname);
+
+	//the network is sized from the header before any weight is read, so every dimension must
+	//be positive and have the sections it implies, each of them inside the file
+	if (h->layers == 0 || h->input == 0 || h->hidden == 0 || h->block < 1 || h->block > INT_MAX ||
+		h->layers > h->sections || h->input > m.size || h->hidden > m.size / 4 || 4 * h->hidden > INT_MAX)
+		throw runtime_error("Malformed save file " + fname);
+	uint64_t g = 4 * h->hidden;
+	for (uint32_t l = 0; l < h->layers; l++){
+		find_section(m, SEC_BLOCK_W, l, g, (l == 0) ? h->input : h->hidden);
+		find_section(m, SEC_BLOCK_U, l, g, h->hidden);
+		find_section(m, SEC_BLOCK_B, l, 1, g);
+	}
+	find_section(m, SEC_OUTPUT_W, 0, h->hidden, h->input);
+	find_section(m, SEC_OUTPUT_B, 0, 1, h->input);
+
+	if (verify){
+		FileHeader zeroed = *h;
+		zeroed.checksum = 0;
+		uint64_t sum = checksum((const char*) &zeroed, sizeof zeroed);
+		if (checksum(m.addr + sizeof (FileHeader), m.size - sizeof (FileHeader), sum) != h->checksum)
+			throw runtime_error("Checksum mismatch in " + fname);
+	}
+	return h;
+}
+
+/* Copy rows of a section, converting from the precision F it was saved in */
+template <class F>
+static void load_rows(const Mapping& m, const FileSection& s, real* dst, size_t stride){
+	for (size_t r = 0; r < s.rows; r++){
+		const F* row = (const F*) (m.addr + s.offset) + r * s.stride;
+		for (size_t c = 0; c < s.cols; c++)
+			dst[r * stride + c] = row[c];
+	}
+}
+
+static void load_rows(const Mapping& m, const FileSection& s, real* dst, size_t stride){
+	if (((const FileHeader*) m.addr)->precision == sizeof (float))
+		load_rows<float>(m, s, dst, stride);
+	else
+		load_rows<double>(m, s, dst, stride);
+}
+
+/*
+Load the weights of a mapped file into a network
+Matrices borrow the mapping when it has their layout, otherwise they are copied
+*/
+static void load_net(Net* net, const Mapping& m, bool borrow){
+	const FileHeader* h = (const FileHeader*) m.addr;
+	for (size_t l = 0; l < net->block.size(); l++){
+		Block* blk = net->block[l];
+		Matrix<real>* mats[2] = {&blk->w, &blk->u};
+		uint32_t kinds[2] = {SEC_BLOCK_W, SEC_BLOCK_U};
+		for (int k = 0; k < 2; k++){
+			const FileSection& s = find_section(m, kinds[k], l, mats[k]->rows(), mats[k]->cols());
+			if (borrow && h->precision == sizeof (real) && s.stride == (uint64_t) mats[k]->stride())
+				mats[k]->borrow((real*) (m.addr + s.offset));
+			else
+				load_rows(m, s, mats[k]->data(), mats[k]->stride());
+		}
+		load_rows(m, find_section(m, SEC_BLOCK_B, l, 1, blk->b.size()), blk->b.data(), 0);
+		blk->transpose_input();
+	}
+	Output* out = net->output;
+	const FileSection& s = find_section(m, SEC_OUTPUT_W, 0, out->w.rows(), out->w.cols());
+	if (borrow && h->precision == sizeof (real) && s.stride == (uint64_t) out->w.stride())
+		out->w.borrow((real*) (m.addr + s.offset));
+	else
+		load_rows(m, s, out->w.data(), out->w.stride());
+	load_rows(m, find_section(m, SEC_OUTPUT_B, 0, 1, out->b.size()), out->b.data(), 0);
+
+	//training progress, from where an interrupted run can resume
+	if (lookup(m, SEC_CURSOR, 0)){
+		FileCursor c;
+		memcpy(&c, m.addr + find_section(m, SEC_CURSOR, 0, 1, sizeof c).offset, sizeof c);
+		TrainCursor& t = net->cursor;
+		t.step = c.step;
+		t.chars = c.chars;
+		t.limit = c.limit;
+		t.rate = c.rate;
+		t.lambda = c.lambda;
+		t.streams = c.streams;
+		t.threads = c.threads;
+	}
+}
+
+static Net* new_net(const FileHeader* h){
+	return new Net(new string(), h->layers, h->input, h->hidden, h->block, false);
+}
+
+/*
+Read a network written by write_net into weights of its own, converting precision as needed
+The network owns an empty data string, ready for run() or further training
+*/
+Net* read_net(string fname){
+	Mapping m(fname);
+	Net* net = new_net(check_file(m, fname, true));
+	try {
+		load_net(net, m, false);
+	} catch (...){
+		delete net;
+		throw;
+	}
+	net->trained = true;
+	return net;
+}
+
+/*
+Map a network written by write_net, its weight matrices pointing straight into the
+read-only file pages, which every process mapping the file shares
+Skipping verification avoids reading the whole file up front
+*/
+Net* map_net(string fname, bool verify){
+	Mapping* m = new Mapping(fname);
+	Net* net = NULL;
+	try {
+		net = new_net(check_file(*m, fname, verify));
+		net->mapping = m;
+		load_net(net, *m, true);
+	} catch (...){
+		if (net)
+			delete net;
+		else
+			delete m;
+		throw;
+	}
+	net->trained = true;
+	return net;
+}
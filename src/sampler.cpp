@@ -0,0 +1,131 @@
+/*******************************************************************************
+ * Name        : sampler.cpp
+ * Author      : Ben Blease
+ * Date        : 11/12/17
+ * Description : Drawing characters from predicted distributions
+ ******************************************************************************/
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "sampler.h"
+
+using namespace std;
+
+Sampler::Sampler(uint64_t s, const SampleParams& p): params(p) {
+  seed(s);
+}
+
+/* The generator's state from splitmix64, so nearby seeds give unrelated streams */
+void Sampler::seed(uint64_t s){
+  for (int i = 0; i < 4; i++){
+    uint64_t z = (s += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    rng[i] = z ^ (z >> 31);
+  }
+}
+
+static inline uint64_t rotl(uint64_t x, int k){
+  return (x << k) | (x >> (64 - k));
+}
+
+uint64_t Sampler::next(){
+  uint64_t out = rotl(rng[1] * 5, 7) * 9;
+  uint64_t t = rng[1] << 17;
+  rng[2] ^= rng[0];
+  rng[3] ^= rng[1];
+  rng[1] ^= rng[2];
+  rng[0] ^= rng[3];
+  rng[2] ^= t;
+  rng[3] = rotl(rng[3], 45);
+  return out;
+}
+
+/* The top 53 bits as a fraction */
+double Sampler::uniform(){
+  return (next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void Sampler::reserve(size_t s){
+  if (w.size() < s){
+    w.resize(s);
+    idx.resize(s);
+  }
+}
+
+size_t Sampler::greedy(const real* p, size_t s){
+  return max_element(p, p + s) - p;
+}
+
+size_t Sampler::draw(const real* p, size_t s){
+  if (s == 0)
+    throw runtime_error("Nothing to draw from");
+  if (params.temperature <= 0)
+    return greedy(p, s);
+  size_t k = (params.top_k && params.top_k < s) ? params.top_k : s;
+
+  //straight from the distribution, by where a uniform draw falls in its running sum
+  if (params.temperature == 1 && k == s && params.top_p >= 1){
+    double total = 0;
+    for (size_t i = 0; i < s; i++)
+      total += p[i];
+    double r = uniform() * total;
+    size_t i = 0;
+    for (; i + 1 < s; i++){
+      r -= p[i];
+      if (r < 0)
+        break;
+    }
+    return i;
+  }
+
+  //tempering keeps the order of the weights, so the candidates are picked and sorted on the
+  //raw ones, leaving only those left to temper
+  reserve(s);
+  for (size_t i = 0; i < s; i++)
+    idx[i] = i;
+  auto likelier = [p](int a, int b){ return p[a] > p[b]; };
+  size_t n = s;
+  if (k < s){
+    nth_element(idx.begin(), idx.begin() + (k - 1), idx.begin() + s, likelier);
+    n = k;
+  }
+  if (params.top_p < 1)
+    sort(idx.begin(), idx.begin() + n, likelier);
+
+  //relative to the largest weight, so a low temperature cannot underflow them all
+  const real* q = p;
+  if (params.temperature != 1){
+    double top = p[greedy(p, s)];
+    double inv = 1 / params.temperature;
+    for (size_t j = 0; j < n; j++)
+      w[idx[j]] = (top > 0) ? pow(p[idx[j]] / top, inv) : 1;
+    q = w.data();
+  }
+
+  if (params.top_p < 1){
+    double total = 0;
+    for (size_t j = 0; j < n; j++)
+      total += q[idx[j]];
+    double held = 0;
+    size_t j = 0;
+    while (j < n){
+      held += q[idx[j++]];
+      if (held >= params.top_p * total)
+        break;
+    }
+    n = j;
+  }
+
+  double total = 0;
+  for (size_t j = 0; j < n; j++)
+    total += q[idx[j]];
+  double r = uniform() * total;
+  for (size_t j = 0; j + 1 < n; j++){
+    r -= q[idx[j]];
+    if (r < 0)
+      return idx[j];
+  }
+  return idx[n - 1];
+}
@@ -6,23 +6,24 @@
  ******************************************************************************/
 
 #include <stdexcept>
+#include <algorithm>
 #include "serialized.h"
 
 template <class T>
 std::vector<T> Matrix<T>::operator*(const std::vector<T>& b){
-	std::vector<T> out;
-	for (int i = 0; i < _y; i++){
-		out.push_back(_v[i] * b);
-	}
+	if (b.size() != (size_t) _x)
+		throw std::runtime_error("Multiplication vectors not aligned ");
+
+	std::vector<T> out = std::vector<T>(_y);
+	kernels<T>().gemv(data(), _y, _x, _stride, b.data(), out.data(), false);
 	return out;
 }
 
 template <class T>
 Matrix<T> Matrix<T>::operator*(double b){
-	Matrix<T> out = Matrix(_v);
-	for (int i = 0; i < _y; i++){
-		out._v[i] = out._v[i] * b;
-	}
+	Matrix<T> out = *this;
+	for (size_t i = 0; i < out.elements(); i++)
+		out._p[i] *= b;
 	return out;
 }
 
@@ -34,9 +35,9 @@ Matrix<T> Matrix<T>::operator+(const Matrix<T>& b){
 		return *this;
 	}
 
-	Matrix<T> out = Matrix<T>(_v);
-	for (int i = 0; i < _y; i++)
-		out._v[i] = out._v[i] + b._v[i];
+	Matrix<T> out = *this;
+	for (size_t i = 0; i < out.elements(); i++)
+		out._p[i] += b._p[i];
 	return out;
 }
 
@@ -48,9 +49,9 @@ Matrix<T> Matrix<T>::operator-(const Matrix<T>& b){
 		return *this;
 	}
 
-	Matrix<T> out = Matrix<T>(_v);
-	for (int i = 0; i < _y; i++)
-		out._v[i] = out._v[i] - b._v[i];
+	Matrix<T> out = *this;
+	for (size_t i = 0; i < out.elements(); i++)
+		out._p[i] -= b._p[i];
 	return out;
 }
 
@@ -63,42 +64,160 @@ Matrix<T> Matrix<T>::h_prod(const Matrix<T>& b){
 	}
 	
 	Matrix<T> out = Matrix<T>(_x, _y);
-	for (int i = 0; i < _y; i++)
-    	for (int j = 0; j < _x; j++)
-    		out._v[i][j] = _v[i][j] * b._v[i][j];
-  	return out;
+	for (size_t i = 0; i < out.elements(); i++)
+		out._p[i] = _p[i] * b._p[i];
+	return out;
 }
 
 template <class T>
 std::vector<T> Matrix<T>::mat_sum_x(){
-	std::vector<T> out;
+	std::vector<T> out = std::vector<T>(_y, 0.0);
 	for (int i = 0; i < _y; i++){
-	    T sum;
-	    for (int j = 0; j < _x; j++)
-	      sum += _v[i][j];
-	    out.push_back(sum);
-  	}
-  return out;
+		const T* r = (*this)[i];
+		T sum = 0;
+		for (int j = 0; j < _x; j++)
+			sum += r[j];
+		out[i] = sum;
+	}
+	return out;
 }
 
 template <class T>
 std::vector<T> Matrix<T>::mat_sum_y(){
 	std::vector<T> out = std::vector<T>(_x, 0.0);
 	for (int i = 0; i < _y; i++){
-	    out = out + _v[i];
-  	}
-  return out;
+		const T* r = (*this)[i];
+		for (int j = 0; j < _x; j++)
+			out[j] += r[j];
+	}
+	return out;
 }
 
 template <class T>
 std::vector<T> Matrix<T>::mult_x(const std::vector<T>& b){
 	std::vector<T> out = this->mat_sum_x(); 
-	for (int i = 0; i < out.size(); i++){
+	for (size_t i = 0; i < out.size(); i++){
 		out[i] *= b[i];
 	}
 	return out;
 }
 
+template <class T>
+void Matrix<T>::gemv(const std::vector<T>& b, std::vector<T>& out, bool acc){
+	if (b.size() != (size_t) _x)
+		throw std::runtime_error("Multiplication vectors not aligned ");
+
+	if (!acc)
+		out.resize(_y);
+	else if (out.size() != (size_t) _y)
+		throw std::runtime_error("Accumulation vector not aligned ");
+
+	kernels<T>().gemv(data(), _y, _x, _stride, b.data(), out.data(), acc);
+}
+
+template <class T>
+void Matrix<T>::gemv_t(const std::vector<T>& b, std::vector<T>& out, bool acc){
+	if (b.size() != (size_t) _y)
+		throw std::runtime_error("Multiplication vectors not aligned ");
+
+	if (!acc)
+		out.assign(_x, 0);
+	else if (out.size() != (size_t) _x)
+		throw std::runtime_error("Accumulation vector not aligned ");
+
+	//walk rows so every access stays contiguous
+	const Kernels<T>& k = kernels<T>();
+	for (int i = 0; i < _y; i++)
+		k.axpy(b[i], (*this)[i], out.data(), _x);
+}
+
+template <class T>
+void Matrix<T>::gemv(const T* b, T* out, bool acc){
+	kernels<T>().gemv(data(), _y, _x, _stride, b, out, acc);
+}
+
+template <class T>
+void Matrix<T>::gemv_t(const T* b, T* out, bool acc){
+	gemm_t(b, _y, out, _x, 1, acc);
+}
+
+template <class T>
+void Matrix<T>::gemm(const T* b, size_t ldb, T* out, size_t ldo, size_t n, bool acc){
+	kernels<T>().gemm(data(), _y, _x, _stride, b, ldb, out, ldo, n, acc);
+}
+
+template <class T>
+void Matrix<T>::gemm_t(const T* b, size_t ldb, T* out, size_t ldo, size_t n, bool acc){
+	if (!acc)
+		for (size_t s = 0; s < n; s++)
+			std::fill(out + s * ldo, out + s * ldo + _x, 0);
+	//out_s += sum over rows i of b_s[i] * M_i
+	kernels<T>().row_update(out, n, _x, ldo, 1, b, ldb, 1, data(), _stride, _y);
+}
+
+template <class T>
+void Matrix<T>::add_outer(double a, const T* x, const T* y){
+	add_outer(a, x, 0, y, 0, 1);
+}
+
+template <class T>
+void Matrix<T>::add_outer(double a, const T* x, size_t ldx, const T* y, size_t ldy, size_t n){
+	//M_i += a * sum over streams of x_s[i] * y_s
+	kernels<T>().row_update(data(), _y, _x, _stride, a, x, 1, ldx, y, ldy, n);
+}
+
+template <class T>
+Matrix<T>& Matrix<T>::operator+=(const Matrix<T>& b){
+	if (_x != b._x 
+		|| _y != b._y)
+		throw std::runtime_error("Addition matrices are not aligned");
+
+	kernels<T>().axpy(1, b.data(), data(), elements());
+	return *this;
+}
+
+template <class T>
+Matrix<T>& Matrix<T>::operator-=(const Matrix<T>& b){
+	if (_x != b._x 
+		|| _y != b._y)
+		throw std::runtime_error("Subtraction matrices are not aligned");
+
+	kernels<T>().axpy(-1, b.data(), data(), elements());
+	return *this;
+}
+
+template <class T>
+Matrix<T>& Matrix<T>::operator*=(double b){
+	for (size_t i = 0; i < elements(); i++)
+		_p[i] *= b;
+	return *this;
+}
+
+template <class T>
+void Matrix<T>::axpy(double a, const Matrix<T>& b){
+	if (_x != b._x 
+		|| _y != b._y)
+		throw std::runtime_error("Axpy matrices are not aligned");
+
+	kernels<T>().axpy(a, b.data(), data(), elements());
+}
+
+template <class T>
+void Matrix<T>::add_outer(double a, const std::vector<T>& x, const std::vector<T>& y){
+	if (x.size() != (size_t) _y || y.size() != (size_t) _x)
+		throw std::runtime_error("Outer product not aligned");
+
+	const Kernels<T>& k = kernels<T>();
+	for (int i = 0; i < _y; i++)
+		k.axpy(a * x[i], y.data(), (*this)[i], _x);
+}
+
+template <class T>
+void Matrix<T>::fill(T val){
+	for (int i = 0; i < _y; i++)
+		std::fill((*this)[i], (*this)[i] + _x, val);
+}
+
 template <class T>
 std::pair<int, int> Matrix<T>::size(){
 	return std::pair<int, int>(_x, _y);
@@ -106,29 +225,110 @@ std::pair<int, int> Matrix<T>::size(){
 
 template <class T>
 void Matrix<T>::randomize(){
-	for (int i = 0; i < _y; i++)
-      for (int j  = 0; j < _x; j++)
-        _v[i][j] = ((double) rand() / RAND_MAX) * 2 - 1;
+	for (int i = 0; i < _y; i++){
+		T* r = (*this)[i];
+		for (int j = 0; j < _x; j++)
+			r[j] = ((double) rand() / RAND_MAX) * 2 - 1;
+	}
 }
 
 template <class T>
 void Matrix<T>::print_matrix(){
-	print_vector(_v[0]);
-	std::cout << "..." << std::endl;
-	print_vector(_v[_v.size() - 1]);
+	if (_y == 0)
+		return;
+	int rows[2] = {0, _y - 1};
+	for (int k = 0; k < 2; k++){
+		const T* r = (*this)[rows[k]];
+		std::cout << "[";
+		for (int j = 0; j < _x; j++)
+			std::cout << r[j] << ((j != _x - 1) ? " " : "");
+		std::cout << "]" << std::endl;
+		if (k == 0)
+			std::cout << "..." << std::endl;
+	}
+}
+
+template <class T>
+MatrixView<T> Matrix<T>::view(){
+	return MatrixView<T>(data(), _x, _y, _stride);
 }
 
 template <class T>
-Matrix<T>::Matrix(const std::vector<std::vector<T> >& v): _v(v), _y(v.size()), _x(v[0].size()) { }
+MatrixView<T> Matrix<T>::row(int i){
+	return MatrixView<T>((*this)[i], _x, 1, _stride);
+}
 
 template <class T>
-Matrix<T>::Matrix(int x, int y): _v(std::vector<std::vector<T> >(y, std::vector<T>(x))), _x(x), _y(y) { }
+MatrixView<T> Matrix<T>::block(int c, int r, int cols, int rows){
+	if (c < 0 || r < 0 || c + cols > _x || r + rows > _y)
+		throw std::runtime_error("Matrix block out of range");
+	return MatrixView<T>((*this)[r] + c, cols, rows, _stride);
+}
 
+/* Round a row length up to a whole number of aligned blocks */
 template <class T>
-Matrix<T>::Matrix(int x, int y, T val): _v(std::vector<std::vector<T> >(y, std::vector<T>(x, val))), _x(x), _y(y) { }
+int Matrix<T>::padded(int x){
+	int per = MATRIX_ALIGN / sizeof(T);
+	if (per <= 1)
+		return x;
+	return ((x + per - 1) / per) * per;
+}
+
+template <class T>
+Matrix<T>::Matrix(const std::vector<std::vector<T> >& v): _x(v.empty() ? 0 : v[0].size()), _y(v.size()) {
+	_stride = padded(_x);
+	_v = std::vector<T, AlignedAllocator<T> >((size_t) _y * _stride, 0);
+	_p = _v.empty() ? NULL : &_v[0];
+	for (int i = 0; i < _y; i++)
+		std::copy(v[i].begin(), v[i].begin() + _x, (*this)[i]);
+}
+
+template <class T>
+Matrix<T>::Matrix(int x, int y): _x(x), _y(y), _stride(padded(x)), _v((size_t) y * padded(x), 0) {
+	_p = _v.empty() ? NULL : &_v[0];
+}
+
+template <class T>
+Matrix<T>::Matrix(int x, int y, T val): _x(x), _y(y), _stride(padded(x)), _v((size_t) y * padded(x), 0) {
+	_p = _v.empty() ? NULL : &_v[0];
+	for (int i = 0; i < _y; i++)
+		std::fill((*this)[i], (*this)[i] + _x, val);
+}
+
+template <class T>
+Matrix<T>::Matrix(const Matrix<T>& m): _x(m._x), _y(m._y), _stride(m._stride), _v(m._p, m._p + m.elements()) {
+	_p = _v.empty() ? NULL : &_v[0];
+}
+
+template <class T>
+Matrix<T>& Matrix<T>::operator=(const Matrix<T>& m){
+	if (this == &m)
+		return *this;
+	_x = m._x;
+	_y = m._y;
+	_stride = m._stride;
+	_v.assign(m._p, m._p + m.elements());
+	_p = _v.empty() ? NULL : &_v[0];
+	return *this;
+}
+
+template <class T>
+void Matrix<T>::own(){
+	if (borrowed()){
+		_v.assign(_p, _p + elements());
+		_p = &_v[0];
+	}
+}
+
+template <class T>
+void Matrix<T>::borrow(T* p){
+	std::vector<T, AlignedAllocator<T> >().swap(_v);
+	_p = p;
+}
 
 template <class T>
-Matrix<T>::Matrix() { }
+Matrix<T>::Matrix(): _x(0), _y(0), _stride(0), _p(NULL) { }
 
 //declare potential templated usage
-template class Matrix<double>;
\ No newline at end of file
+template class Matrix<double>;
+template class Matrix<float>;
\ No newline at end of file
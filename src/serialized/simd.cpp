@@ -0,0 +1,200 @@
+/*******************************************************************************
+ * Name        : simd.cpp
+ * Author      : Ben Blease
+ * Date        : 10/26/17
+ * Description : Scalar reference kernels and runtime dispatch by CPUID
+ ******************************************************************************/
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include "simd.h"
+
+namespace scalar {
+
+#include "kernels.inc"
+
+/* One lane, libm exp; the reference every vector path is checked against */
+struct f64 {
+  typedef double T;
+  typedef double V;
+  enum { W = 1 };
+
+  static V zero() { return 0.0; }
+  static V set1(T a) { return a; }
+  static V load(const T* p) { return *p; }
+  static V load_i8(const int8_t* p) { return *p; }
+  static void store(T* p, V v) { *p = v; }
+  static V add(V a, V b) { return a + b; }
+  static V sub(V a, V b) { return a - b; }
+  static V mul(V a, V b) { return a * b; }
+  static V div(V a, V b) { return a / b; }
+  static V min(V a, V b) { return std::min(a, b); }
+  static V max(V a, V b) { return std::max(a, b); }
+  static V fmadd(V a, V b, V c) { return a * b + c; }
+  static T hsum(V v) { return v; }
+  static V exp(V x) { return std::exp(x); }
+  static V pow2_mul(V p, V t) { return std::ldexp(p, (int) (t - ExpConst<T>::magic())); }
+};
+
+struct f32 {
+  typedef float T;
+  typedef float V;
+  enum { W = 1 };
+
+  static V zero() { return 0.0f; }
+  static V set1(T a) { return a; }
+  static V load(const T* p) { return *p; }
+  static V load_i8(const int8_t* p) { return *p; }
+  static void store(T* p, V v) { *p = v; }
+  static V add(V a, V b) { return a + b; }
+  static V sub(V a, V b) { return a - b; }
+  static V mul(V a, V b) { return a * b; }
+  static V div(V a, V b) { return a / b; }
+  static V min(V a, V b) { return std::min(a, b); }
+  static V max(V a, V b) { return std::max(a, b); }
+  static V fmadd(V a, V b, V c) { return a * b + c; }
+  static T hsum(V v) { return v; }
+  static V exp(V x) { return std::exp(x); }
+  static V pow2_mul(V p, V t) { return std::ldexp(p, (int) (t - ExpConst<T>::magic())); }
+};
+
+}
+
+//defined by the per instruction set files
+const Kernels<double>* sse2_kernels_d(Accuracy);
+const Kernels<double>* avx2_kernels_d(Accuracy);
+const Kernels<double>* avx512_kernels_d(Accuracy);
+const Kernels<float>* sse2_kernels_f(Accuracy);
+const Kernels<float>* avx2_kernels_f(Accuracy);
+const Kernels<float>* avx512_kernels_f(Accuracy);
+
+bool isa_supported(Isa isa){
+  __builtin_cpu_init();
+  switch (isa){
+    case ISA_SCALAR:
+      return true;
+    case ISA_SSE2:
+      return __builtin_cpu_supports("sse2");
+    case ISA_AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case ISA_AVX512:
+      return __builtin_cpu_supports("avx512f");
+    default:
+      return false;
+  }
+}
+
+const char* isa_name(Isa isa){
+  static const char* names[ISA_COUNT] = {"scalar", "sse2", "avx2", "avx512"};
+  return (isa >= 0 && isa < ISA_COUNT) ? names[isa] : "unknown";
+}
+
+/*
+Highest supported instruction set
+RNN_ISA=<name> in the environment caps it, e.g. to reproduce results from an older machine
+*/
+static Isa best_isa(){
+  Isa cap = (Isa) (ISA_COUNT - 1);
+  const char* env = getenv("RNN_ISA");
+  if (env){
+    for (int i = 0; i < ISA_COUNT; i++)
+      if (strcmp(env, isa_name((Isa) i)) == 0)
+        cap = (Isa) i;
+  }
+  for (int i = cap; i > ISA_SCALAR; i--)
+    if (isa_supported((Isa) i))
+      return (Isa) i;
+  return ISA_SCALAR;
+}
+
+const char* accuracy_name(Accuracy a){
+  static const char* names[ACC_COUNT] = {"exact", "1e-6", "1e-3"};
+  return (a >= 0 && a < ACC_COUNT) ? names[a] : "unknown";
+}
+
+static Accuracy initial_accuracy(){
+  const char* env = getenv("RNN_ACCURACY");
+  if (env){
+    for (int i = 0; i < ACC_COUNT; i++)
+      if (strcmp(env, accuracy_name((Accuracy) i)) == 0)
+        return (Accuracy) i;
+  }
+  return ACC_EXACT;
+}
+
+static Accuracy current_accuracy = initial_accuracy();
+
+void set_accuracy(Accuracy a){
+  if (a < 0 || a >= ACC_COUNT)
+    throw std::runtime_error("Unknown accuracy tier");
+  current_accuracy = a;
+}
+
+Accuracy accuracy(){
+  return current_accuracy;
+}
+
+template <>
+const Kernels<double>* kernels<double>(Isa isa, Accuracy a){
+  static const scalar::Tiers<scalar::f64> ref("scalar");
+  if (!isa_supported(isa) || a < 0 || a >= ACC_COUNT)
+    return NULL;
+  switch (isa){
+    case ISA_SSE2:
+      return sse2_kernels_d(a);
+    case ISA_AVX2:
+      return avx2_kernels_d(a);
+    case ISA_AVX512:
+      return avx512_kernels_d(a);
+    default:
+      return &ref.k[a];
+  }
+}
+
+template <>
+const Kernels<float>* kernels<float>(Isa isa, Accuracy a){
+  static const scalar::Tiers<scalar::f32> ref("scalar");
+  if (!isa_supported(isa) || a < 0 || a >= ACC_COUNT)
+    return NULL;
+  switch (isa){
+    case ISA_SSE2:
+      return sse2_kernels_f(a);
+    case ISA_AVX2:
+      return avx2_kernels_f(a);
+    case ISA_AVX512:
+      return avx512_kernels_f(a);
+    default:
+      return &ref.k[a];
+  }
+}
+
+template <>
+const Kernels<double>& kernels<double>(){
+  static const Kernels<double>* best[ACC_COUNT] = {
+    kernels<double>(best_isa(), ACC_EXACT), kernels<double>(best_isa(), ACC_1E6),
+    kernels<double>(best_isa(), ACC_1E3) };
+  return *best[current_accuracy];
+}
+
+template <>
+const Kernels<float>& kernels<float>(){
+  static const Kernels<float>* best[ACC_COUNT] = {
+    kernels<float>(best_isa(), ACC_EXACT), kernels<float>(best_isa(), ACC_1E6),
+    kernels<float>(best_isa(), ACC_1E3) };
+  return *best[current_accuracy];
+}
+
+template <class T>
+int fixed_shape(size_t n){
+  const FixedKernels<T>* f = kernels<T>().fixed;
+  for (int i = 0; i < FIXED_SHAPES; i++)
+    if (f[i].n == n)
+      return i;
+  return -1;
+}
+
+template int fixed_shape<double>(size_t);
+template int fixed_shape<float>(size_t);
@@ -0,0 +1,86 @@
+/*******************************************************************************
+ * Name        : simd_avx2.cpp
+ * Author      : Ben Blease
+ * Date        : 10/26/17
+ * Description : AVX2 + FMA kernels (256 bit)
+ ******************************************************************************/
+
+#include <immintrin.h>
+#include <cstring>
+#include "simd.h"
+
+namespace avx2 {
+
+#include "kernels.inc"
+
+struct f64 {
+  typedef double T;
+  typedef __m256d V;
+  enum { W = 4 };
+
+  static V zero() { return _mm256_setzero_pd(); }
+  static V set1(T a) { return _mm256_set1_pd(a); }
+  static V load(const T* p) { return _mm256_loadu_pd(p); }
+  static V load_i8(const int8_t* p) {
+    int32_t b;
+    memcpy(&b, p, 4);
+    return _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(b)));
+  }
+  static void store(T* p, V v) { _mm256_storeu_pd(p, v); }
+  static V add(V a, V b) { return _mm256_add_pd(a, b); }
+  static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+  static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+  static V div(V a, V b) { return _mm256_div_pd(a, b); }
+  static V min(V a, V b) { return _mm256_min_pd(a, b); }
+  static V max(V a, V b) { return _mm256_max_pd(a, b); }
+  static V fmadd(V a, V b, V c) { return _mm256_fmadd_pd(a, b, c); }
+  static T hsum(V v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+  }
+  static V pow2_mul(V p, V t) {
+    return _mm256_castsi256_pd(_mm256_add_epi64(_mm256_castpd_si256(p), _mm256_slli_epi64(_mm256_castpd_si256(t), 52)));
+  }
+  static V exp(V x) { return vexp<f64>(x); }
+};
+
+
+struct f32 {
+  typedef float T;
+  typedef __m256 V;
+  enum { W = 8 };
+
+  static V zero() { return _mm256_setzero_ps(); }
+  static V set1(T a) { return _mm256_set1_ps(a); }
+  static V load(const T* p) { return _mm256_loadu_ps(p); }
+  static V load_i8(const int8_t* p) { return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*) p))); }
+  static void store(T* p, V v) { _mm256_storeu_ps(p, v); }
+  static V add(V a, V b) { return _mm256_add_ps(a, b); }
+  static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+  static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+  static V div(V a, V b) { return _mm256_div_ps(a, b); }
+  static V min(V a, V b) { return _mm256_min_ps(a, b); }
+  static V max(V a, V b) { return _mm256_max_ps(a, b); }
+  static V fmadd(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+  static T hsum(V v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+  }
+  static V pow2_mul(V p, V t) {
+    return _mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(p), _mm256_slli_epi32(_mm256_castps_si256(t), 23)));
+  }
+  static V exp(V x) { return vexp<f32>(x); }
+};
+
+}
+
+const Kernels<double>* avx2_kernels_d(Accuracy a){
+  static const avx2::Tiers<avx2::f64> tiers("avx2");
+  return &tiers.k[a];
+}
+
+const Kernels<float>* avx2_kernels_f(Accuracy a){
+  static const avx2::Tiers<avx2::f32> tiers("avx2");
+  return &tiers.k[a];
+}
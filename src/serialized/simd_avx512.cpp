@@ -0,0 +1,163 @@
+/*******************************************************************************
+ * Name        : simd_avx512.cpp
+ * Author      : Ben Blease
+ * Date        : 10/26/17
+ * Description : AVX-512F kernels (512 bit)
+ ******************************************************************************/
+
+#include <immintrin.h>
+#include "simd.h"
+
+namespace avx512 {
+
+#include "kernels.inc"
+
+struct f64 {
+  typedef double T;
+  typedef __m512d V;
+  enum { W = 8 };
+
+  static V zero() { return _mm512_setzero_pd(); }
+  static V set1(T a) { return _mm512_set1_pd(a); }
+  static V load(const T* p) { return _mm512_loadu_pd(p); }
+  static V load_i8(const int8_t* p) { return _mm512_cvtepi32_pd(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*) p))); }
+  static void store(T* p, V v) { _mm512_storeu_pd(p, v); }
+  static V add(V a, V b) { return _mm512_add_pd(a, b); }
+  static V sub(V a, V b) { return _mm512_sub_pd(a, b); }
+  static V mul(V a, V b) { return _mm512_mul_pd(a, b); }
+  static V div(V a, V b) { return _mm512_div_pd(a, b); }
+  static V min(V a, V b) { return _mm512_min_pd(a, b); }
+  static V max(V a, V b) { return _mm512_max_pd(a, b); }
+  static V fmadd(V a, V b, V c) { return _mm512_fmadd_pd(a, b, c); }
+  static T hsum(V v) { return _mm512_reduce_add_pd(v); }
+  static V pow2_mul(V p, V t) {
+    return _mm512_castsi512_pd(_mm512_add_epi64(_mm512_castpd_si512(p), _mm512_slli_epi64(_mm512_castpd_si512(t), 52)));
+  }
+  static V exp(V x) { return vexp<f64>(x); }
+};
+
+
+struct f32 {
+  typedef float T;
+  typedef __m512 V;
+  enum { W = 16 };
+
+  static V zero() { return _mm512_setzero_ps(); }
+  static V set1(T a) { return _mm512_set1_ps(a); }
+  static V load(const T* p) { return _mm512_loadu_ps(p); }
+  static V load_i8(const int8_t* p) { return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*) p))); }
+  static void store(T* p, V v) { _mm512_storeu_ps(p, v); }
+  static V add(V a, V b) { return _mm512_add_ps(a, b); }
+  static V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+  static V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+  static V div(V a, V b) { return _mm512_div_ps(a, b); }
+  static V min(V a, V b) { return _mm512_min_ps(a, b); }
+  static V max(V a, V b) { return _mm512_max_ps(a, b); }
+  static V fmadd(V a, V b, V c) { return _mm512_fmadd_ps(a, b, c); }
+  static T hsum(V v) { return _mm512_reduce_add_ps(v); }
+  static V pow2_mul(V p, V t) {
+    return _mm512_castsi512_ps(_mm512_add_epi32(_mm512_castps_si512(p), _mm512_slli_epi32(_mm512_castps_si512(t), 23)));
+  }
+  static V exp(V x) { return vexp<f32>(x); }
+};
+
+/* Longest x gemv_q8x8 rounds on the stack; longer ones take gemv_q8 */
+#define Q8_MAX_COLS 4096
+
+/*
+gemv_q8 on VNNI: x is rounded to int8 by its largest magnitude, and each product of 64 bytes
+is one dpbusd, which multiplies unsigned bytes by signed ones, so the weights are offset by
+128 to unsigned and 128 times the sum of x taken off again; a row's tail is a masked load,
+the x past its end zero
+Only compiled for the AVX-512 VNNI target, so only reached when the CPU has it
+*/
+template <class S>
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+void k_gemv_q8x8(const int8_t* q, size_t rows, size_t cols, size_t stride, const float* scale,
+                 const typename S::T* x, typename S::T* out, bool acc){
+  typedef typename S::T T;
+  if (cols > Q8_MAX_COLS){
+    k_gemv_q8<S>(q, rows, cols, stride, scale, x, out, acc);
+    return;
+  }
+  T top = 0;
+  for (size_t i = 0; i < cols; i++)
+    top = (x[i] > top) ? x[i] : (-x[i] > top) ? -x[i] : top;
+  size_t padded = (cols + 63) & ~(size_t) 63;
+  __attribute__((aligned(64))) int8_t xq[Q8_MAX_COLS];
+  T sx = top / 127;
+  T inv = (top > 0) ? 127 / top : 0;
+  int xsum = 0;
+  for (size_t i = 0; i < cols; i++){
+    T v = x[i] * inv;
+    int r = (int) (v + (v < 0 ? -0.5 : 0.5));
+    xq[i] = (int8_t) r;
+    xsum += r;
+  }
+  for (size_t i = cols; i < padded; i++)
+    xq[i] = 0;
+  T offset = 128 * (T) xsum;
+
+  const __m512i flip = _mm512_set1_epi8((char) 0x80);
+  size_t full = cols & ~(size_t) 63;
+  __mmask64 tail = (cols == full) ? 0 : (~(__mmask64) 0 >> (64 - (cols - full)));
+  size_t r = 0;
+  for (; r + 4 <= rows; r += 4){
+    const int8_t* q0 = q + r * stride;
+    const int8_t* q1 = q0 + stride;
+    const int8_t* q2 = q1 + stride;
+    const int8_t* q3 = q2 + stride;
+    __m512i a0 = _mm512_setzero_si512(), a1 = a0, a2 = a0, a3 = a0;
+    size_t i = 0;
+    for (; i < full; i += 64){
+      __m512i xv = _mm512_load_si512((const void*) (xq + i));
+      a0 = _mm512_dpbusd_epi32(a0, _mm512_xor_si512(_mm512_loadu_si512((const void*) (q0 + i)), flip), xv);
+      a1 = _mm512_dpbusd_epi32(a1, _mm512_xor_si512(_mm512_loadu_si512((const void*) (q1 + i)), flip), xv);
+      a2 = _mm512_dpbusd_epi32(a2, _mm512_xor_si512(_mm512_loadu_si512((const void*) (q2 + i)), flip), xv);
+      a3 = _mm512_dpbusd_epi32(a3, _mm512_xor_si512(_mm512_loadu_si512((const void*) (q3 + i)), flip), xv);
+    }
+    if (tail){
+      __m512i xv = _mm512_load_si512((const void*) (xq + i));
+      a0 = _mm512_dpbusd_epi32(a0, _mm512_xor_si512(_mm512_maskz_loadu_epi8(tail, q0 + i), flip), xv);
+      a1 = _mm512_dpbusd_epi32(a1, _mm512_xor_si512(_mm512_maskz_loadu_epi8(tail, q1 + i), flip), xv);
+      a2 = _mm512_dpbusd_epi32(a2, _mm512_xor_si512(_mm512_maskz_loadu_epi8(tail, q2 + i), flip), xv);
+      a3 = _mm512_dpbusd_epi32(a3, _mm512_xor_si512(_mm512_maskz_loadu_epi8(tail, q3 + i), flip), xv);
+    }
+    T s[4] = {(T) _mm512_reduce_add_epi32(a0), (T) _mm512_reduce_add_epi32(a1),
+              (T) _mm512_reduce_add_epi32(a2), (T) _mm512_reduce_add_epi32(a3)};
+    for (int j = 0; j < 4; j++){
+      T v = (s[j] - offset) * sx * scale[r + j];
+      out[r + j] = acc ? out[r + j] + v : v;
+    }
+  }
+  for (; r < rows; r++){
+    const int8_t* qr = q + r * stride;
+    int sum = 0;
+    for (size_t i = 0; i < cols; i++)
+      sum += qr[i] * xq[i];
+    T v = sum * sx * scale[r];
+    out[r] = acc ? out[r] + v : v;
+  }
+}
+
+/* The tiers, with gemv_q8x8 added when the CPU has VNNI */
+template <class S>
+struct VnniTiers : Tiers<S> {
+  explicit VnniTiers(const char* name): Tiers<S>(name) {
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni"))
+      for (int a = 0; a < ACC_COUNT; a++)
+        this->k[a].gemv_q8x8 = &k_gemv_q8x8<S>;
+  }
+};
+
+}
+
+const Kernels<double>* avx512_kernels_d(Accuracy a){
+  static const avx512::VnniTiers<avx512::f64> tiers("avx512");
+  return &tiers.k[a];
+}
+
+const Kernels<float>* avx512_kernels_f(Accuracy a){
+  static const avx512::VnniTiers<avx512::f32> tiers("avx512");
+  return &tiers.k[a];
+}
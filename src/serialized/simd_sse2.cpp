@@ -0,0 +1,107 @@
+/*******************************************************************************
+ * Name        : simd_sse2.cpp
+ * Author      : Ben Blease
+ * Date        : 10/26/17
+ * Description : SSE2 kernels (128 bit)
+ ******************************************************************************/
+
+#include <immintrin.h>
+#include <cstring>
+#include "simd.h"
+
+namespace sse2 {
+
+#include "kernels.inc"
+
+/*
+n <= 4 int8 sign extended to 32 bit lanes; SSE2 has no such conversion, so each byte is
+spread over its lane and shifted down
+*/
+static inline __m128i widen_i8(const int8_t* p, int n){
+  int32_t b = 0;
+  memcpy(&b, p, n);
+  __m128i v = _mm_cvtsi32_si128(b);
+  v = _mm_unpacklo_epi8(v, v);
+  v = _mm_unpacklo_epi16(v, v);
+  return _mm_srai_epi32(v, 24);
+}
+
+struct f64 {
+  typedef double T;
+  typedef __m128d V;
+  enum { W = 2 };
+
+  static V zero() { return _mm_setzero_pd(); }
+  static V set1(T a) { return _mm_set1_pd(a); }
+  static V load(const T* p) { return _mm_loadu_pd(p); }
+  static V load_i8(const int8_t* p) { return _mm_cvtepi32_pd(widen_i8(p, 2)); }
+  static void store(T* p, V v) { _mm_storeu_pd(p, v); }
+  static V add(V a, V b) { return _mm_add_pd(a, b); }
+  static V sub(V a, V b) { return _mm_sub_pd(a, b); }
+  static V mul(V a, V b) { return _mm_mul_pd(a, b); }
+  static V div(V a, V b) { return _mm_div_pd(a, b); }
+  static V min(V a, V b) { return _mm_min_pd(a, b); }
+  static V max(V a, V b) { return _mm_max_pd(a, b); }
+  static V fmadd(V a, V b, V c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+  static T hsum(V v) { return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v))); }
+  static V pow2_mul(V p, V t) {
+    return _mm_castsi128_pd(_mm_add_epi64(_mm_castpd_si128(p), _mm_slli_epi64(_mm_castpd_si128(t), 52)));
+  }
+  static V exp(V x) { return vexp<f64>(x); }
+};
+
+
+struct f32 {
+  typedef float T;
+  typedef __m128 V;
+  enum { W = 4 };
+
+  static V zero() { return _mm_setzero_ps(); }
+  static V set1(T a) { return _mm_set1_ps(a); }
+  static V load(const T* p) { return _mm_loadu_ps(p); }
+  static V load_i8(const int8_t* p) { return _mm_cvtepi32_ps(widen_i8(p, 4)); }
+  static void store(T* p, V v) { _mm_storeu_ps(p, v); }
+  static V add(V a, V b) { return _mm_add_ps(a, b); }
+  static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+  static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+  static V div(V a, V b) { return _mm_div_ps(a, b); }
+  static V min(V a, V b) { return _mm_min_ps(a, b); }
+  static V max(V a, V b) { return _mm_max_ps(a, b); }
+  static V fmadd(V a, V b, V c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+  static T hsum(V v) {
+    V s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+  }
+  static V pow2_mul(V p, V t) {
+    return _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(p), _mm_slli_epi32(_mm_castps_si128(t), 23)));
+  }
+  static V exp(V x) { return vexp<f32>(x); }
+};
+
+}
+
+namespace sse2 {
+
+/*
+The double tiers, keeping libm's activations at the exact tier: two lanes of the full
+degree polynomial without FMA do not beat it, the shorter ones of the faster tiers do
+*/
+struct DoubleTiers : Tiers<f64> {
+  DoubleTiers(): Tiers<f64>("sse2") {
+    const Kernels<double>* ref = kernels<double>(ISA_SCALAR, ACC_EXACT);
+    for (int f = 0; f < ACTIVATION_COUNT; f++)
+      k[ACC_EXACT].activate[f] = ref->activate[f];
+  }
+};
+
+}
+
+const Kernels<double>* sse2_kernels_d(Accuracy a){
+  static const sse2::DoubleTiers tiers;
+  return &tiers.k[a];
+}
+
+const Kernels<float>* sse2_kernels_f(Accuracy a){
+  static const sse2::Tiers<sse2::f32> tiers("sse2");
+  return &tiers.k[a];
+}
@@ -2,10 +2,11 @@
  Vector function implementations
 */
 
+#include <stdexcept>
 #include "serialized.h"
 
 /* Print a vector */
-void print_vector(const std::vector<double>& v){
+void print_vector(const std::vector<real>& v){
   std::cout << "[";
   for (int i = 0; i < v.size(); i++){
     std::cout << v[i];
@@ -16,43 +17,40 @@ void print_vector(const std::vector<double>& v){
 }
 
 /* Vector product of a and b */
-double operator*(const std::vector<double>& a, const std::vector<double>& b){
-  double out = 0.0;
+real operator*(const std::vector<real>& a, const std::vector<real>& b){
   if (a.size() != b.size()){
     throw std::runtime_error("Multiplication vectors not aligned ");
     return 0.0;
   }
-  for (int i = 0; i < a.size(); i++)
-    out += a[i] * b[i];
-  return out;
+  return kernels<real>().dot(a.data(), b.data(), a.size());
 }
 
 /* Take the sum of a vector */
-double v_sum(const std::vector<double>& v){
-  double out;
+real v_sum(const std::vector<real>& v){
+  real out = 0;
   for (int i = 0; i < v.size(); i++)
     out += v[i];
   return out;
 }
 
 /* Multiply vector by double */
-std::vector<double> operator*(const std::vector<double>& a, double b){
-  std::vector<double> out;
+std::vector<real> operator*(const std::vector<real>& a, double b){
+  std::vector<real> out;
   for (int i = 0; i < a.size(); i++)
     out.push_back(a[i] * b);
   return out;
 }
 
-std::vector<double> operator/(const std::vector<double>& a, double b){
-  std::vector<double> out;
+std::vector<real> operator/(const std::vector<real>& a, double b){
+  std::vector<real> out;
   for (int i = 0; i < a.size(); i++)
     out.push_back(a[i] / b);
   return out;
 }
 
 /* Add two vectors elementwise */
-std::vector<double> operator+(const std::vector<double>& a, const std::vector<double>& b){
-  std::vector<double> out;
+std::vector<real> operator+(const std::vector<real>& a, const std::vector<real>& b){
+  std::vector<real> out;
   if (a.size() != b.size()){
     throw std::runtime_error("Addition vectors not aligned ");
     return out;
@@ -62,8 +60,8 @@ std::vector<double> operator+(const std::vector<double>& a, const std::vector<do
   return out;
 }
 
-std::vector<double> operator-(const std::vector<double>& a, const std::vector<double>& b){
-  std::vector<double> out;
+std::vector<real> operator-(const std::vector<real>& a, const std::vector<real>& b){
+  std::vector<real> out;
   if (a.size() != b.size()){
     throw std::runtime_error("Subtraction vectors not aligned ");
     return out;
@@ -73,26 +71,95 @@ std::vector<double> operator-(const std::vector<double>& a, const std::vector<do
   return out;
 }
 
-std::vector<double> h_prod(const std::vector<double>& a, const std::vector<double>& b){
-  std::vector<double> out;
+std::vector<real> h_prod(const std::vector<real>& a, const std::vector<real>& b){
+  std::vector<real> out;
   if (a.size() != b.size()){
     throw std::runtime_error("Hadamard Product vectors not aligned");
     return out; //return an empty vector
   }
-  for (int i = 0; i < a.size(); i++)
-    out.push_back(a[i] * b[i]);
+  out.resize(a.size());
+  kernels<real>().h_prod(a.data(), b.data(), out.data(), a.size());
   return out;
 }
 
 /* Apply an activation function on a vector */
-std::vector<double> activate(const std::vector<double>& x, double(*f)(const double&)){
-  std::vector<double> out;
+std::vector<real> activate(const std::vector<real>& x, double(*f)(const double&)){
+  std::vector<real> out;
   for (int i = 0; i < x.size(); i++){
     out.push_back(f(x[i]));
   }
   return out;
 }
 
+std::vector<real> activate(const std::vector<real>& x, Activation f){
+  std::vector<real> out = std::vector<real>(x.size());
+  kernels<real>().activate[f](x.data(), out.data(), x.size());
+  return out;
+}
+
+void activate(const std::vector<real>& x, std::vector<real>& out, Activation f){
+  out.resize(x.size());
+  kernels<real>().activate[f](x.data(), out.data(), x.size());
+}
+
+/* Add b into a elementwise */
+std::vector<real>& operator+=(std::vector<real>& a, const std::vector<real>& b){
+  if (a.size() != b.size())
+    throw std::runtime_error("Addition vectors not aligned ");
+  for (size_t i = 0; i < a.size(); i++)
+    a[i] += b[i];
+  return a;
+}
+
+std::vector<real>& operator-=(std::vector<real>& a, const std::vector<real>& b){
+  if (a.size() != b.size())
+    throw std::runtime_error("Subtraction vectors not aligned ");
+  for (size_t i = 0; i < a.size(); i++)
+    a[i] -= b[i];
+  return a;
+}
+
+std::vector<real>& operator*=(std::vector<real>& a, double b){
+  for (size_t i = 0; i < a.size(); i++)
+    a[i] *= b;
+  return a;
+}
+
+std::vector<real>& operator/=(std::vector<real>& a, double b){
+  for (size_t i = 0; i < a.size(); i++)
+    a[i] /= b;
+  return a;
+}
+
+/* y += a * x */
+void axpy(double a, const std::vector<real>& x, std::vector<real>& y){
+  if (x.size() != y.size())
+    throw std::runtime_error("Axpy vectors not aligned ");
+  kernels<real>().axpy(a, x.data(), y.data(), x.size());
+}
+
+/* Hadamard product written into out */
+void h_prod(const std::vector<real>& a, const std::vector<real>& b, std::vector<real>& out){
+  if (a.size() != b.size())
+    throw std::runtime_error("Hadamard Product vectors not aligned");
+  out.resize(a.size());
+  kernels<real>().h_prod(a.data(), b.data(), out.data(), a.size());
+}
+
+/* Fused multiply-add of a Hadamard product into out */
+void h_prod_add(const std::vector<real>& a, const std::vector<real>& b, std::vector<real>& out){
+  if (a.size() != b.size() || a.size() != out.size())
+    throw std::runtime_error("Hadamard Product vectors not aligned");
+  kernels<real>().h_prod_add(a.data(), b.data(), out.data(), a.size());
+}
+
+/* Apply an activation function into out (out may alias x) */
+void activate(const std::vector<real>& x, std::vector<real>& out, double(*f)(const double&)){
+  out.resize(x.size());
+  for (size_t i = 0; i < x.size(); i++)
+    out[i] = f(x[i]);
+}
+
 
 // /* DEPRECATED */
 
@@ -100,8 +167,8 @@ std::vector<double> activate(const std::vector<double>& x, double(*f)(const doub
 
 // /*
 // /* Multiply a 2d matrix and a vector */
-// vector<double> operator*(const vector<vector<double> >& a, const vector<double>& b){
-//   vector<double> out;
+// vector<real> operator*(const vector<vector<real> >& a, const vector<real>& b){
+//   vector<real> out;
 //   for (int i = 0; i < a.size(); i++){
 //     out.push_back(a[i] * b);
 //   }
@@ -109,8 +176,8 @@ std::vector<double> activate(const std::vector<double>& x, double(*f)(const doub
 // }
 
 // /* Multiply a 2s matrix and a double */
-// vector<vector<double> > operator*(const vector<vector<double> >& a, double b){
-//   vector<vector<double> > out;
+// vector<vector<real> > operator*(const vector<vector<real> >& a, double b){
+//   vector<vector<real> > out;
 //   for (int i = 0; i < a.size(); i++){
 //     out.push_back(a[i] * b);
 //   }
@@ -118,8 +185,8 @@ std::vector<double> activate(const std::vector<double>& x, double(*f)(const doub
 // }
 
 // /* Subtract two 2d matrices */
-// vector<vector<double> > operator-(const vector<vector<double> >& a, const vector<vector<double> >& b){
-//   vector<vector<double> > out;
+// vector<vector<real> > operator-(const vector<vector<real> >& a, const vector<vector<real> >& b){
+//   vector<vector<real> > out;
 //   if (a.size() != b.size()){
 //     throw invalid_argument("Subtraction vectors not aligned ");
 //     return out;
@@ -129,8 +196,8 @@ std::vector<double> activate(const std::vector<double>& x, double(*f)(const doub
 //   return out;
 // }
 
-// vector<vector<double> > operator+(const vector<vector<double> >& a, const vector<vector<double> >& b){
-//   vector<vector<double> > out;
+// vector<vector<real> > operator+(const vector<vector<real> >& a, const vector<vector<real> >& b){
+//   vector<vector<real> > out;
 //   if (a.size() != b.size()){
 //     throw invalid_argument("Addition vectors not aligned ");
 //     return out;
@@ -140,8 +207,8 @@ std::vector<double> activate(const std::vector<double>& x, double(*f)(const doub
 //   return out;
 // }
 
-// vector<vector<double> > h_prod(const vector<vector<double> >& a, const vector<vector<double> >& b){
-//   vector<vector<double> > out;
+// vector<vector<real> > h_prod(const vector<vector<real> >& a, const vector<vector<real> >& b){
+//   vector<vector<real> > out;
 //   if (a.size() != b.size()){
 //     throw invalid_argument("Hadamard product vectors not aligned");
 //     return out; //return an empty vector
@@ -152,8 +219,8 @@ std::vector<double> activate(const std::vector<double>& x, double(*f)(const doub
 // }
 
 // /* Take the sum of all rows of a matrix */
-// vector<double> mat_sum(const vector<vector<double> >& a){
-//   vector<double> out;
+// vector<real> mat_sum(const vector<vector<real> >& a){
+//   vector<real> out;
 //   for (int i = 0; i < a.size(); i++){
 //     double sum;
 //     for (int j = 0; j < a[i].size(); j++)
@@ -164,10 +231,10 @@ std::vector<double> activate(const std::vector<double>& x, double(*f)(const doub
 // }
 
 // /* Transpose a matrix */
-// vector<vector<double> > transpose(const vector<vector<double> >& a){
-//   vector<vector<double> > out;
+// vector<vector<real> > transpose(const vector<vector<real> >& a){
+//   vector<vector<real> > out;
 //   for (int i = 0; i < a[0].size(); i++){
-//     vector<double> curr;
+//     vector<real> curr;
 //     for (int j = 0; j < a.size(); j++){
 //       curr.push_back(a[j][i]);
 //     }
@@ -176,7 +243,7 @@ std::vector<double> activate(const std::vector<double>& x, double(*f)(const doub
 //   return out;
 // }
 
-// vector<double> mult_x(const vector<vector<double> >& a, const vector<double>& b){
+// vector<real> mult_x(const vector<vector<real> >& a, const vector<real>& b){
 //   return h_prod(mat_sum(a), b);
 // }
 
@@ -0,0 +1,250 @@
+/*******************************************************************************
+ * Name        : server.cpp
+ * Author      : Ben Blease
+ * Date        : 11/6/17
+ * Description : Batched inference over many sessions at once
+ ******************************************************************************/
+
+#include <sstream>
+#include <cstdlib>
+#include <cerrno>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "server.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+Engine::Engine(Net* n, int c, size_t bytes):
+               net(n),
+               ctx(n->layer_num, n->inp_size, n->node_num, c),
+               capacity(c),
+               index(c),
+               next_id(0),
+               cache(NULL) {
+  if (c < 1)
+    throw runtime_error("An engine needs room for at least one session");
+  slots.reserve(c);
+  if (bytes)
+    cache = new PrefixCache(n->layer_num, n->node_num, bytes);
+}
+
+Engine::~Engine(){
+  delete cache;
+}
+
+long Engine::submit(const string& prompt, size_t length, const SampleParams& params){
+  if (prompt.empty())
+    throw runtime_error("Empty prompt");
+  if (length == 0)
+    throw runtime_error("Nothing to generate");
+  Session s;
+  s.id = next_id++;
+  s.prompt = prompt;
+  s.length = length;
+  s.fed = 0;
+  s.shared = 0;
+  s.sampler.seed(s.id);
+  s.sampler.params = params;
+  s.arrived = Clock::now();
+  s.first = 0;
+  s.latency = 0;
+  queue.push_back(s);
+  return s.id;
+}
+
+/* Into the next free row, from a clear state or the longest cached prefix of its prompt */
+void Engine::admit(){
+  size_t k = slots.size();
+  slots.push_back(queue.front());
+  queue.pop_front();
+  if (cache){
+    slots[k].fed = cache->restore(slots[k].prompt, ctx, k, slots[k].shared);
+    return;
+  }
+  for (size_t l = 0; l < ctx.h.size(); l++){
+    size_t n = net->node_num;
+    fill(ctx.h[l].begin() + k * n, ctx.h[l].begin() + (k + 1) * n, 0.0);
+    fill(ctx.state[l].begin() + k * n, ctx.state[l].begin() + (k + 1) * n, 0.0);
+  }
+}
+
+/* The last session moves into the freed row, keeping the active rows together */
+void Engine::retire(int k){
+  int last = slots.size() - 1;
+  if (k != last){
+    size_t n = net->node_num;
+    for (size_t l = 0; l < ctx.h.size(); l++){
+      copy(ctx.h[l].begin() + last * n, ctx.h[l].begin() + (last + 1) * n, ctx.h[l].begin() + k * n);
+      copy(ctx.state[l].begin() + last * n, ctx.state[l].begin() + (last + 1) * n, ctx.state[l].begin() + k * n);
+    }
+    slots[k] = slots[last];
+  }
+  slots.pop_back();
+}
+
+/*
+Each session feeds its next prompt character, or once through the prompt its last output,
+and samples an output from the prediction once the whole prompt is in
+*/
+void Engine::step(vector<Session>& done){
+  while (!queue.empty() && (int) slots.size() < capacity)
+    admit();
+  if (slots.empty())
+    return;
+
+  Clock::time_point start = Clock::now();
+  int k = slots.size();
+  ctx.streams = k;
+  for (int j = 0; j < k; j++){
+    Session& s = slots[j];
+    index[j] = char_index((s.fed < s.prompt.length()) ? s.prompt[s.fed] : s.out.back());
+  }
+  net->input->forward(ctx, NULL, index.data(), NULL);
+
+  //snapshots where a prompt leaves an earlier one, which the next to share that much resumes
+  //from, and just before its end, which a repeat of it resumes from
+  size_t n = net->inp_size;
+  for (int j = 0; j < k; j++){
+    Session& s = slots[j];
+    if (++s.fed >= s.prompt.length())
+      s.out += s.sampler.pick(ctx.o.data() + j * n, n);
+    else if (cache && (s.fed == s.shared || s.fed + 1 == s.prompt.length()))
+      cache->store(s.prompt, s.fed, ctx, j);
+  }
+  Clock::time_point end = Clock::now();
+  for (int j = 0; j < k; j++)
+    if (slots[j].out.length() == 1)
+      slots[j].first = chrono::duration<double>(end - slots[j].arrived).count();
+  //back to front, so a session moved into a freed row has already been checked
+  for (int j = k - 1; j >= 0; j--){
+    if (slots[j].out.length() < slots[j].length)
+      continue;
+    slots[j].latency = chrono::duration<double>(end - slots[j].arrived).count();
+    stats.requests++;
+    stats.generated += slots[j].length;
+    done.push_back(slots[j]);
+    retire(j);
+  }
+  stats.steps++;
+  stats.occupancy += k;
+  stats.busy += chrono::duration<double>(end - start).count();
+}
+
+static void print_stats(const Engine& engine, ostream& out){
+  const EngineStats& st = engine.stats;
+  const PrefixCache* cache = engine.prefixes();
+  out << "stats " << st.requests << " " << st.generated << " " << (long) (st.busy > 0 ? st.generated / st.busy : 0)
+      << " " << (st.steps ? (double) st.occupancy / st.steps : 0.0) << " "
+      << ((cache && cache->stats.lookups) ? (double) cache->stats.hits / cache->stats.lookups : 0.0) << endl;
+}
+
+/* A whole word as an integer, nothing left over */
+static long parse_long(const string& word, const string& name){
+  char* end = NULL;
+  errno = 0;
+  long value = strtol(word.c_str(), &end, 10);
+  if (end == word.c_str() || *end || errno == ERANGE)
+    throw runtime_error("Expected a whole number for " + name);
+  return value;
+}
+
+/* A whole word as a finite number, nothing left over */
+static double parse_double(const string& word, const string& name){
+  char* end = NULL;
+  double value = strtod(word.c_str(), &end);
+  if (end == word.c_str() || *end || !std::isfinite(value))
+    throw runtime_error("Expected a number for " + name);
+  return value;
+}
+
+/* One name=value sampling option of a request */
+static void parse_option(const string& word, SampleParams& params){
+  size_t eq = word.find('=');
+  string name = word.substr(0, eq);
+  string value = word.substr(eq + 1);
+  bool ok = false;
+  if (name == "temperature"){
+    params.temperature = parse_double(value, name);
+    ok = params.temperature >= 0;
+  } else if (name == "top_k"){
+    long k = parse_long(value, name);
+    params.top_k = (size_t) k;
+    ok = k >= 0;
+  } else if (name == "top_p"){
+    params.top_p = parse_double(value, name);
+    ok = params.top_p > 0 && params.top_p <= 1;
+  }
+  if (!ok)
+    throw runtime_error("Unknown option or value out of range: " + word);
+}
+
+/*
+A thread reads requests into an inbox while the engine steps, so requests arriving
+mid-generation join the next step; the engine only blocks on the inbox when it is idle
+*/
+void serve(Net* net, int capacity, size_t cache, istream& in, ostream& out){
+  Engine engine(net, capacity, cache);
+  mutex m;
+  condition_variable cv;
+  deque<string> inbox;
+  bool closed = false;
+  thread reader([&]{
+    string line;
+    while (getline(in, line)){
+      lock_guard<mutex> lock(m);
+      inbox.push_back(line);
+      cv.notify_all();
+    }
+    lock_guard<mutex> lock(m);
+    closed = true;
+    cv.notify_all();
+  });
+
+  vector<Session> done;
+  while (true){
+    deque<string> lines;
+    {
+      unique_lock<mutex> lock(m);
+      if (!engine.active() && !engine.waiting())
+        cv.wait(lock, [&]{ return !inbox.empty() || closed; });
+      lines.swap(inbox);
+      if (lines.empty() && closed && !engine.active() && !engine.waiting())
+        break;
+    }
+    for (const string& line : lines){
+      if (line == "stats"){
+        print_stats(engine, out);
+        continue;
+      }
+      istringstream request(line);
+      SampleParams params;
+      long length = -1;
+      string word, prompt;
+      try {
+        //sampling options lead, up to the length
+        while (request >> word && word.find('=') != string::npos)
+          parse_option(word, params);
+        length = parse_long(word, "the length");
+        request.get();
+        getline(request, prompt);
+        if (request.fail() || length < 0)
+          throw runtime_error("Expected [name=value ...] <length> <prompt>");
+        engine.submit(prompt, length, params);
+      } catch (runtime_error& e){
+        out << "error " << e.what() << endl;
+      }
+    }
+
+    engine.step(done);
+    for (const Session& s : done)
+      out << s.id << " " << (long) (s.latency * 1e6) << " " << s.out << endl;
+    done.clear();
+  }
+  reader.join();
+  print_stats(engine, out);
+}